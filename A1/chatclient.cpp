@@ -0,0 +1,500 @@
+// Event-loop driven client library for bots running many chat sessions
+
+#include "chatclient.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <netinet/in.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+#define READ_SIZE 4096
+#define BACKOFF_MIN_MS 500          // First reconnect delay
+#define BACKOFF_MAX_MS 30000        // Reconnect delay cap
+#define IDLE_TIMEOUT_MS 15000       // Silence (heartbeats included) before reconnecting
+#define PENDING_LIMIT 1024          // Commands kept while a session is offline
+
+namespace {
+
+int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Remove colour codes and the line ending; bots want the plain text
+std::string plain_text(const std::string &line) {
+    std::string text;
+    size_t start = 0;
+    while (start < line.size()) {
+        size_t escape = line.find("\x1b[", start);
+        text.append(line, start, escape == std::string::npos ? std::string::npos : escape - start);
+        if (escape == std::string::npos)
+            break;
+        size_t end = line.find('m', escape);
+        start = end == std::string::npos ? line.size() : end + 1;
+    }
+    while (!text.empty() && (text.back() == '\n' || text.back() == '\r'))
+        text.pop_back();
+    return text;
+}
+
+/**
+ * Skip colour codes
+ * @param data: input buffer
+ * @param pos: start of a line
+ * @return: position after the complete "\x1b[...m" codes at pos
+ */
+size_t skip_colour(const std::string &data, size_t pos) {
+    while (data.compare(pos, 2, "\x1b[") == 0) {
+        size_t end = data.find('m', pos);
+        if (end == std::string::npos)
+            break;
+        pos = end + 1;
+    }
+    return pos;
+}
+
+} // namespace
+
+ChatClient::ChatClient(const std::string &host, int port) : host(host), port(port) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        throw std::runtime_error(std::string("epoll_create1: ") + strerror(errno));
+}
+
+ChatClient::~ChatClient() {
+    for (auto &entry : sessions) {
+        if (entry.second.fd != -1)
+            close(entry.second.fd);
+    }
+    close(epoll_fd);
+}
+
+/**
+ * Add a session
+ * @param username: login name
+ * @param password: password
+ * @param last_seq: sequence number to resume from, e.g. saved by a previous run
+ * @return: session id, passed to every callback
+ */
+int ChatClient::add_session(const std::string &username, const std::string &password,
+                            uint64_t last_seq) {
+    int id = next_session++;
+    Session &s = sessions[id];
+    s.id = id;
+    s.username = username;
+    s.password = password;
+    s.lastSeq = last_seq;
+    connect_session(s);
+    return id;
+}
+
+/**
+ * Remove a session
+ * @param session: session id
+ * Safe to call from a callback; the session is freed at the end of poll().
+ */
+void ChatClient::remove_session(int session) {
+    auto it = sessions.find(session);
+    if (it == sessions.end() || it->second.removed)
+        return;
+    close_session(it->second);
+    it->second.removed = true;
+    removedSessions.push_back(session);
+}
+
+/**
+ * Send a command
+ * @param session: session id
+ * @param command: command line, e.g. "/group_msg bots hello"
+ * Commands issued while the session is offline are sent, in order, once it
+ * has logged in again.
+ */
+void ChatClient::send(int session, const std::string &command) {
+    auto it = sessions.find(session);
+    if (it == sessions.end() || it->second.removed)
+        return;
+    Session &s = it->second;
+    std::string line = command;
+    if (line.empty() || line.back() != '\n')
+        line.push_back('\n');
+    if (s.state == SessionState::READY) {
+        write(s, line);
+        return;
+    }
+    if (s.state == SessionState::FAILED)
+        return;
+    if (s.pending.size() >= PENDING_LIMIT)
+        s.pending.pop_front();
+    s.pending.push_back(line);
+}
+
+SessionState ChatClient::state(int session) const {
+    auto it = sessions.find(session);
+    return it == sessions.end() ? SessionState::FAILED : it->second.state;
+}
+
+uint64_t ChatClient::last_seq(int session) const {
+    auto it = sessions.find(session);
+    return it == sessions.end() ? 0 : it->second.lastSeq;
+}
+
+const std::string &ChatClient::username(int session) const {
+    static const std::string none;
+    auto it = sessions.find(session);
+    return it == sessions.end() ? none : it->second.username;
+}
+
+/**
+ * Start a non-blocking connect
+ * @param s: session
+ */
+void ChatClient::connect_session(Session &s) {
+    s.inbuf.clear();
+    s.outbuf.clear();
+    s.state = SessionState::CONNECTING;
+    s.lastReceive = now_ms();
+
+    s.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s.fd == -1) {
+        schedule_retry(s, std::string("socket: ") + strerror(errno));
+        return;
+    }
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1) {
+        fail_session(s, "invalid server address " + host);
+        return;
+    }
+    if (connect(s.fd, (sockaddr *)&address, sizeof(address)) == -1 && errno != EINPROGRESS) {
+        schedule_retry(s, std::string("connect: ") + strerror(errno));
+        return;
+    }
+    fdToSession[s.fd] = s.id;
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data.fd = s.fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s.fd, &ev);
+}
+
+void ChatClient::close_session(Session &s) {
+    if (s.fd == -1)
+        return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s.fd, nullptr);
+    fdToSession.erase(s.fd);
+    close(s.fd);
+    s.fd = -1;
+}
+
+/**
+ * Schedule a reconnect
+ * @param s: session
+ * @param reason: why the connection was lost
+ * The delay doubles from BACKOFF_MIN_MS up to BACKOFF_MAX_MS, with jitter so
+ * a fleet of bots does not reconnect in lockstep after a server restart.
+ */
+void ChatClient::schedule_retry(Session &s, const std::string &reason) {
+    bool was_ready = s.state == SessionState::READY;
+    close_session(s);
+    s.state = SessionState::RETRY_WAIT;
+    s.backoffMs = s.backoffMs == 0 ? BACKOFF_MIN_MS : std::min<int64_t>(s.backoffMs * 2, BACKOFF_MAX_MS);
+    std::uniform_int_distribution<int64_t> jitter(0, s.backoffMs / 2);
+    s.retryAt = now_ms() + s.backoffMs / 2 + jitter(rng);
+    if (was_ready && disconnectHandler)
+        disconnectHandler(s.id, reason);
+}
+
+/**
+ * Give up on a session
+ * @param s: session
+ * @param reason: e.g. rejected credentials; the session is not retried
+ */
+void ChatClient::fail_session(Session &s, const std::string &reason) {
+    close_session(s);
+    s.state = SessionState::FAILED;
+    s.pending.clear();
+    if (disconnectHandler)
+        disconnectHandler(s.id, reason);
+}
+
+/**
+ * Queue bytes for the server
+ * @param s: session
+ * @param data: bytes to send
+ */
+void ChatClient::write(Session &s, const std::string &data) {
+    s.outbuf += data;
+    flush(s);
+}
+
+void ChatClient::flush(Session &s) {
+    if (s.fd == -1 || s.state == SessionState::CONNECTING)
+        return;
+    while (!s.outbuf.empty()) {
+        ssize_t n = ::send(s.fd, s.outbuf.data(), s.outbuf.size(), MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                schedule_retry(s, std::string("send: ") + strerror(errno));
+            break;
+        }
+        s.outbuf.erase(0, n);
+    }
+    if (s.fd != -1)
+        watch(s, !s.outbuf.empty());
+}
+
+void ChatClient::watch(Session &s, bool want_write) {
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    if (want_write)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = s.fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s.fd, &ev);
+}
+
+/**
+ * Handle a socket event
+ * @param s: session
+ * @param events: epoll event mask
+ */
+void ChatClient::handle_event(Session &s, uint32_t events) {
+    if (s.state == SessionState::CONNECTING && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(s.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            schedule_retry(s, std::string("connect: ") + strerror(error));
+            return;
+        }
+        s.state = SessionState::USERNAME_PROMPT;
+        watch(s, false);
+    }
+    if (events & EPOLLOUT)
+        flush(s);
+
+    if (s.fd != -1 && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        char buf[READ_SIZE];
+        while (s.fd != -1) {
+            ssize_t n = recv(s.fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                s.lastReceive = now_ms();
+                s.inbuf.append(buf, n);
+                continue;
+            }
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            handle_input(s);
+            if (s.fd != -1)
+                schedule_retry(s, n == 0 ? "connection closed" : std::string("recv: ") + strerror(errno));
+            return;
+        }
+        handle_input(s);
+    }
+}
+
+/**
+ * Drive the login exchange, then hand input to handle_ready_input()
+ * @param s: session
+ */
+void ChatClient::handle_input(Session &s) {
+    if (s.state == SessionState::USERNAME_PROMPT && s.inbuf.find("Enter the username") != std::string::npos) {
+        s.inbuf.clear();
+        s.state = SessionState::PASSWORD_PROMPT;
+        write(s, s.username + "\n");
+    } else if (s.state == SessionState::PASSWORD_PROMPT && s.inbuf.find("Enter the password") != std::string::npos) {
+        s.inbuf.clear();
+        s.state = SessionState::WELCOME;
+        write(s, s.password + "\n");
+    } else if (s.state == SessionState::WELCOME) {
+        if (s.inbuf.find("already logged in") != std::string::npos) {
+            // Our previous connection may not have been noticed as dead yet.
+            schedule_retry(s, "already logged in");
+        } else if (s.inbuf.find("Authentication failed") != std::string::npos) {
+            fail_session(s, "authentication failed");
+        } else {
+            size_t welcome = s.inbuf.find("Welcome");
+            size_t end = welcome == std::string::npos ? welcome : s.inbuf.find('\n', welcome);
+            if (end != std::string::npos) {
+                s.inbuf.erase(0, end + 1);
+                become_ready(s);
+            }
+        }
+    }
+    if (s.state == SessionState::READY)
+        handle_ready_input(s);
+}
+
+/**
+ * Logged in: resume from the last sequence number and send what was queued
+ * @param s: session
+ */
+void ChatClient::become_ready(Session &s) {
+    s.state = SessionState::READY;
+    s.backoffMs = 0;
+    s.syncing = true;
+    s.syncSeen.clear();
+    std::string resume = "/heartbeat\n/sync " + std::to_string(s.lastSeq) + "\n";
+    while (!s.pending.empty()) {
+        resume += s.pending.front();
+        s.pending.pop_front();
+    }
+    write(s, resume);
+    if (readyHandler && s.fd != -1)
+        readyHandler(s.id);
+}
+
+/**
+ * Split input into tagged records and lines
+ * @param s: session
+ * Records are "\x1e<seq> <key> <length>\n<text>" at the start of a line;
+ * PING and SYNCED lines are handled here, everything else is passed to the
+ * message handler.
+ */
+void ChatClient::handle_ready_input(Session &s) {
+    size_t start = 0;
+    while (start < s.inbuf.size() && s.state == SessionState::READY && !s.removed) {
+        ChatMessage message{0, "", ""};
+        // A record only starts a line, possibly after the colour reset that
+        // ends the previous reply; '\x1e' anywhere else is plain text.
+        size_t record = skip_colour(s.inbuf, start);
+        if (record < s.inbuf.size() && s.inbuf[record] == '\x1e') {
+            size_t end = s.inbuf.find('\n', record);
+            if (end == std::string::npos)
+                break;
+            std::istringstream head(s.inbuf.substr(record + 1, end - record - 1));
+            size_t length = 0;
+            head >> message.seq >> message.key >> length;
+            if (s.inbuf.size() - (end + 1) < length)
+                break;
+            message.text = s.inbuf.substr(end + 1, length);
+            start = end + 1 + length;
+            if (!s.syncing) {
+                s.lastSeq = std::max(s.lastSeq, message.seq);
+            } else if (!s.syncSeen.insert(message.seq).second) {
+                continue;   // delivered live and then replayed by /sync
+            }
+        } else {
+            size_t end = s.inbuf.find('\n', start);
+            if (end == std::string::npos)
+                break;
+            message.text = s.inbuf.substr(start, end - start);
+            start = end + 1;
+            std::string control = plain_text(message.text);
+            if (control.compare(0, 5, "PING ") == 0) {
+                write(s, "/pong " + control.substr(5) + "\n");
+                continue;
+            }
+            if (control.compare(0, 7, "SYNCED ") == 0) {
+                std::istringstream reply(control.substr(7));
+                uint64_t seq = 0;
+                std::string more;
+                reply >> seq >> more;
+                s.lastSeq = std::max(s.lastSeq, seq);
+                if (more == "more") {
+                    write(s, "/sync " + std::to_string(seq) + "\n");
+                } else {
+                    s.syncing = false;
+                    s.syncSeen.clear();
+                }
+                continue;
+            }
+        }
+        message.text = plain_text(message.text);
+        if (message.text.empty())
+            continue;
+        if (messageHandler)
+            messageHandler(s.id, message);
+    }
+    // The handler may have removed the session, or a write may have failed.
+    if (s.state == SessionState::READY)
+        s.inbuf.erase(0, start);
+}
+
+/**
+ * Reconnect sessions whose backoff expired and drop silent connections
+ * @param now: current time (ms)
+ */
+void ChatClient::run_timers(int64_t now) {
+    // Callbacks may add sessions, so do not iterate the map itself.
+    std::vector<int> ids;
+    ids.reserve(sessions.size());
+    for (const auto &entry : sessions)
+        ids.push_back(entry.first);
+    for (int id : ids) {
+        Session &s = sessions[id];
+        if (s.removed)
+            continue;
+        if (s.state == SessionState::RETRY_WAIT && now >= s.retryAt) {
+            connect_session(s);
+        } else if (s.fd != -1 && now - s.lastReceive > IDLE_TIMEOUT_MS) {
+            schedule_retry(s, "server silent");
+        }
+    }
+}
+
+int ChatClient::next_timeout(int timeout_ms, int64_t now) const {
+    int64_t deadline = timeout_ms < 0 ? -1 : now + timeout_ms;
+    for (const auto &entry : sessions) {
+        const Session &s = entry.second;
+        int64_t due = -1;
+        if (s.state == SessionState::RETRY_WAIT)
+            due = s.retryAt;
+        else if (s.fd != -1)
+            due = s.lastReceive + IDLE_TIMEOUT_MS + 1;
+        if (due != -1 && (deadline == -1 || due < deadline))
+            deadline = due;
+    }
+    return deadline == -1 ? -1 : static_cast<int>(std::max<int64_t>(deadline - now, 0));
+}
+
+/**
+ * Run one event-loop iteration
+ * @param timeout_ms: longest wait for events, -1 to wait until a timer is due
+ * @return: number of socket events handled
+ * Call this from an existing loop (fd() can be added to another epoll or
+ * poll set), or use run().
+ */
+int ChatClient::poll(int timeout_ms) {
+    epoll_event events[MAX_EVENTS];
+    int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, next_timeout(timeout_ms, now_ms()));
+    if (num_events == -1) {
+        if (errno != EINTR)
+            throw std::runtime_error(std::string("epoll_wait: ") + strerror(errno));
+        num_events = 0;
+    }
+    for (int i = 0; i < num_events; ++i) {
+        auto it = fdToSession.find(events[i].data.fd);
+        if (it == fdToSession.end())
+            continue;
+        auto session = sessions.find(it->second);
+        if (session != sessions.end() && !session->second.removed)
+            handle_event(session->second, events[i].events);
+    }
+    run_timers(now_ms());
+
+    for (int id : removedSessions)
+        sessions.erase(id);
+    removedSessions.clear();
+    return num_events;
+}
+
+/**
+ * Run the event loop until stop() is called
+ */
+void ChatClient::run() {
+    running = true;
+    while (running)
+        poll(-1);
+}
@@ -0,0 +1,119 @@
+#ifndef CHATCLIENT_H
+#define CHATCLIENT_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * One message received by a session.
+ * Journaled chat messages carry their sequence number and conversation key
+ * ("b", "g:<group>" or "d:<user>|<user>"); server replies and notices have
+ * seq 0 and an empty key.
+ */
+struct ChatMessage {
+    uint64_t seq;
+    std::string key;
+    std::string text;               // without colour codes and trailing newline
+};
+
+enum class SessionState { CONNECTING, USERNAME_PROMPT, PASSWORD_PROMPT, WELCOME, READY, RETRY_WAIT, FAILED };
+
+/**
+ * Event-loop driven chat client for bots.
+ * Runs any number of sessions (one TCP connection and login each) in the
+ * calling thread, on one epoll instance. Sessions log in by themselves,
+ * answer heartbeat pings, reconnect with exponential backoff when the
+ * connection drops, and resume with /sync from the last sequence number
+ * they saw, so no journaled message is lost across a reconnect. A session
+ * also receives its own journaled messages (the server echoes them to
+ * syncing clients).
+ *
+ *     ChatClient client("127.0.0.1", 12345);
+ *     client.on_message([&](int s, const ChatMessage &m) { ... });
+ *     int bot = client.add_session("alice", "password123");
+ *     client.send(bot, "/broadcast hello");
+ *     client.run();
+ */
+class ChatClient
+{
+public:
+    using MessageHandler = std::function<void(int session, const ChatMessage &message)>;
+    using ReadyHandler = std::function<void(int session)>;
+    using DisconnectHandler = std::function<void(int session, const std::string &reason)>;
+
+    ChatClient(const std::string &host, int port);
+    ~ChatClient();
+    ChatClient(const ChatClient &) = delete;
+    ChatClient &operator=(const ChatClient &) = delete;
+
+    int add_session(const std::string &username, const std::string &password, uint64_t last_seq = 0);
+    void remove_session(int session);
+    void send(int session, const std::string &command);
+
+    void on_message(MessageHandler handler) { messageHandler = std::move(handler); }
+    void on_ready(ReadyHandler handler) { readyHandler = std::move(handler); }
+    void on_disconnect(DisconnectHandler handler) { disconnectHandler = std::move(handler); }
+
+    int poll(int timeout_ms);
+    void run();
+    void stop() { running = false; }
+
+    int fd() const { return epoll_fd; }
+    SessionState state(int session) const;
+    uint64_t last_seq(int session) const;
+    const std::string &username(int session) const;
+
+private:
+    struct Session {
+        int id;
+        std::string username;
+        std::string password;
+        int fd = -1;
+        SessionState state = SessionState::CONNECTING;
+        std::string inbuf;
+        std::string outbuf;
+        std::deque<std::string> pending;    // commands sent before login completed
+        uint64_t lastSeq = 0;               // resume point for /sync
+        bool syncing = false;               // a /sync reply is outstanding
+        std::unordered_set<uint64_t> syncSeen; // records delivered while syncing
+        int64_t backoffMs = 0;
+        int64_t retryAt = 0;
+        int64_t lastReceive = 0;
+        bool removed = false;
+    };
+
+    void connect_session(Session &s);
+    void close_session(Session &s);
+    void schedule_retry(Session &s, const std::string &reason);
+    void fail_session(Session &s, const std::string &reason);
+    void handle_event(Session &s, uint32_t events);
+    void handle_input(Session &s);
+    void handle_ready_input(Session &s);
+    void become_ready(Session &s);
+    void write(Session &s, const std::string &data);
+    void flush(Session &s);
+    void watch(Session &s, bool want_write);
+    void run_timers(int64_t now);
+    int next_timeout(int timeout_ms, int64_t now) const;
+
+    std::string host;
+    int port;
+    int epoll_fd;
+    int next_session = 1;
+    bool running = false;
+    std::mt19937 rng{std::random_device{}()};          // reconnect jitter, seeded per client
+    std::unordered_map<int, Session> sessions;          //? session id -> session
+    std::unordered_map<int, int> fdToSession;           //? socket -> session id
+    std::vector<int> removedSessions;                   //? erased at the end of poll()
+    MessageHandler messageHandler;
+    ReadyHandler readyHandler;
+    DisconnectHandler disconnectHandler;
+};
+
+#endif
@@ -3,6 +3,9 @@
 #include <iostream>
 #include <string>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
 #include <mutex>
 #include <unordered_map>
 #include <unordered_set>
@@ -10,26 +13,286 @@
 #include <sstream>
 #include <cstring>
 #include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 
 #define BUFFER_SIZE 1024
+#define CACHE_SLOTS 1024
+#define RECENT_DEFAULT 20
 
 std::mutex cout_mutex;
+std::mutex send_mutex;
+
+// One cached message; fixed size so the cache is a plain array in the file
+struct CacheSlot {
+    uint64_t seq;
+    uint16_t keyLen;
+    uint16_t textLen;
+    char key[60];
+    char text[440];
+};
+static_assert(sizeof(CacheSlot) == 512, "cache slot must stay 512 bytes");
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t slots;
+    uint32_t next;          // slot written next
+    uint64_t lastSeq;       // everything up to here has been synced
+};
+
+// Recent messages of every conversation, kept in a memory-mapped ring
+// (.chat_cache_<username>) so they survive restarts. Records carry the
+// server's sequence numbers, so on reconnect only newer ones are requested.
+class MessageCache {
+public:
+    bool open(const std::string& username) {
+        std::string name = username;
+        std::replace(name.begin(), name.end(), '/', '_');
+        std::string path = ".chat_cache_" + name;
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd < 0) return false;
+        size_t size = sizeof(CacheHeader) + CACHE_SLOTS * sizeof(CacheSlot);
+        if (ftruncate(fd, size) < 0) {
+            close(fd);
+            return false;
+        }
+        void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) return false;
+        header = static_cast<CacheHeader*>(base);
+        slots = reinterpret_cast<CacheSlot*>(header + 1);
+        if (memcmp(header->magic, "CHATCACH", 8) != 0 || header->slots != CACHE_SLOTS) {
+            memset(base, 0, size);
+            memcpy(header->magic, "CHATCACH", 8);
+            header->slots = CACHE_SLOTS;
+        }
+        return true;
+    }
+
+    uint64_t last_seq() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return header ? header->lastSeq : 0;
+    }
+
+    void set_last_seq(uint64_t seq) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (header && seq > header->lastSeq) header->lastSeq = seq;
+    }
+
+    void store(uint64_t seq, const std::string& key, const std::string& text) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!header) return;
+        CacheSlot& slot = slots[header->next];
+        slot.seq = seq;
+        slot.keyLen = std::min(key.size(), sizeof(slot.key));
+        slot.textLen = std::min(text.size(), sizeof(slot.text));
+        memcpy(slot.key, key.data(), slot.keyLen);
+        memcpy(slot.text, text.data(), slot.textLen);
+        header->next = (header->next + 1) % CACHE_SLOTS;
+    }
+
+    // Cached messages whose conversation key contains filter, oldest first
+    std::vector<std::string> recent(const std::string& filter, size_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::pair<uint64_t, std::string>> found;
+        if (!header) return {};
+        for (uint32_t i = 0; i < CACHE_SLOTS; ++i) {
+            const CacheSlot& slot = slots[i];
+            if (slot.seq == 0) continue;
+            std::string key(slot.key, slot.keyLen);
+            if (key.find(filter) == std::string::npos) continue;
+            found.emplace_back(slot.seq, std::string(slot.text, slot.textLen));
+        }
+        std::sort(found.begin(), found.end());
+        if (found.size() > count) found.erase(found.begin(), found.end() - count);
+        std::vector<std::string> texts;
+        for (auto& entry : found) texts.push_back(entry.second);
+        return texts;
+    }
+
+private:
+    std::mutex mutex;
+    CacheHeader* header = nullptr;
+    CacheSlot* slots = nullptr;
+};
+
+MessageCache cache;
+bool syncing = true;        // a /sync reply is still outstanding
+std::unordered_set<uint64_t> sync_seen;    // records received while syncing
+
+std::atomic<int> latency_interval{0};      // seconds between probes, 0 = off
+std::mutex probe_mutex;
+std::unordered_map<std::string, int64_t> probes_sent;   // token -> send time (us)
+uint64_t next_probe = 1;
+
+// Both threads write to the socket, so sends are serialised
+void send_line(int server_socket, const std::string& message) {
+    std::lock_guard<std::mutex> lock(send_mutex);
+    send(server_socket, message.c_str(), message.size(), 0);
+}
+
+int64_t steady_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Send "/ping <token>" and remember when
+void send_probe(int server_socket) {
+    std::string token;
+    {
+        std::lock_guard<std::mutex> lock(probe_mutex);
+        if (probes_sent.size() > 64) probes_sent.clear();   // replies that never came
+        token = "lat" + std::to_string(next_probe++);
+        probes_sent[token] = steady_us();
+    }
+    send_line(server_socket, "/ping " + token + "\n");
+}
+
+// Probe every latency_interval seconds while latency mode is on
+void probe_latency(int server_socket) {
+    while (true) {
+        int interval = latency_interval;
+        if (interval == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            continue;
+        }
+        send_probe(server_socket);
+        std::this_thread::sleep_for(std::chrono::seconds(interval));
+    }
+}
+
+// Turn "PONG <token> <server receive us> <server send us>" into a latency
+// line: the server's share is its own send minus receive time, and the rest
+// of the round trip is the network (both differences use a single clock)
+std::string describe_pong(const std::string& line) {
+    std::istringstream reply(line.substr(5));
+    std::string token;
+    int64_t received = 0, sent = 0;
+    reply >> token >> received >> sent;
+    int64_t rtt;
+    {
+        std::lock_guard<std::mutex> lock(probe_mutex);
+        auto it = probes_sent.find(token);
+        if (it == probes_sent.end()) return line;
+        rtt = steady_us() - it->second;
+        probes_sent.erase(it);
+    }
+    int64_t server = std::max<int64_t>(sent - received, 0);
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(2)
+        << "[latency] rtt " << rtt / 1000.0 << " ms | server " << server / 1000.0
+        << " ms | network " << std::max<int64_t>(rtt - server, 0) / 1000.0 << " ms\n";
+    return out.str();
+}
+
+// Whether an unterminated line may still become a control line (or the
+// colour code in front of one) once the rest arrives
+bool maybe_control(const std::string& partial) {
+    if (partial.empty()) return false;
+    for (const std::string word : {"PING ", "PONG ", "SYNCED ", "\x1b["}) {
+        size_t n = std::min(partial.size(), word.size());
+        if (partial.compare(0, n, word, 0, n) == 0) return true;
+    }
+    return false;
+}
+
+// Position after the complete colour codes ("\x1b[...m") starting at pos
+size_t skip_colour(const std::string& data, size_t pos) {
+    while (data.compare(pos, 2, "\x1b[") == 0) {
+        size_t end = data.find('m', pos);
+        if (end == std::string::npos) break;
+        pos = end + 1;
+    }
+    return pos;
+}
+
+// Answer server heartbeat pings ("PING <token>"), cache sequence-tagged
+// records ("\x1e<seq> <key> <length>\n<text>") and follow /sync replies
+// ("SYNCED <seq>[ more]"). Returns what should be shown; an incomplete
+// record or control line is left in pending until the rest arrives.
+std::string process_server_data(int server_socket, std::string& pending) {
+    std::string shown;
+    size_t start = 0;
+    while (start < pending.size()) {
+        // A record only starts a line, possibly after the colour reset
+        // that ends the previous reply; '\x1e' elsewhere is plain text
+        size_t record = skip_colour(pending, start);
+        if (record < pending.size() && pending[record] == '\x1e') {
+            size_t end = pending.find('\n', record);
+            if (end == std::string::npos) break;
+            std::istringstream head(pending.substr(record + 1, end - record - 1));
+            uint64_t seq = 0;
+            size_t length = 0;
+            std::string key;
+            head >> seq >> key >> length;
+            if (pending.size() - (end + 1) < length) break;
+            std::string text = pending.substr(end + 1, length);
+            start = end + 1 + length;
+            // A message delivered live may be replayed by /sync as well
+            if (syncing && !sync_seen.insert(seq).second) continue;
+            cache.store(seq, key, text);
+            if (!syncing) cache.set_last_seq(seq);
+            shown += text;
+            continue;
+        }
+        size_t end = pending.find('\n', start);
+        size_t next = (end == std::string::npos) ? pending.size() : end + 1;
+        std::string line = pending.substr(start, next - start);
+        // A control line may follow the colour reset of the previous reply
+        std::string control = line;
+        while (control.compare(0, 2, "\x1b[") == 0 && control.find('m') != std::string::npos) {
+            control.erase(0, control.find('m') + 1);
+        }
+        // A PING split across reads must not be shown as two halves
+        if (end == std::string::npos && maybe_control(control)) break;
+        if (control.compare(0, 5, "PING ") == 0) {
+            std::string token = control.substr(5);
+            while (!token.empty() && (token.back() == '\n' || token.back() == '\r')) token.pop_back();
+            send_line(server_socket, "/pong " + token + "\n");
+        } else if (control.compare(0, 5, "PONG ") == 0) {
+            shown += describe_pong(control);
+        } else if (control.compare(0, 7, "SYNCED ") == 0) {
+            std::istringstream reply(control.substr(7));
+            uint64_t seq = 0;
+            std::string more;
+            reply >> seq >> more;
+            cache.set_last_seq(seq);
+            if (more == "more") {
+                send_line(server_socket, "/sync " + std::to_string(seq) + "\n");
+            } else {
+                syncing = false;
+                sync_seen.clear();
+            }
+        } else {
+            shown += line;
+        }
+        start = next;
+    }
+    pending.erase(0, start);
+    return shown;
+}
 
 void handle_server_messages(int server_socket) {
     char buffer[BUFFER_SIZE];
+    std::string pending;
     while (true) {
         memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
+        int bytes_received = recv(server_socket, buffer, BUFFER_SIZE - 1, 0);
         if (bytes_received <= 0) {
             std::lock_guard<std::mutex> lock(cout_mutex);
             std::cout << "Disconnected from server." << std::endl;
             close(server_socket);
             exit(0);
         }
+        pending.append(buffer, bytes_received);
+        std::string shown = process_server_data(server_socket, pending);
+        if (shown.empty()) continue;
         std::lock_guard<std::mutex> lock(cout_mutex);
-        std::cout << buffer << std::endl;
+        std::cout << shown << std::endl;
     }
 }
 
@@ -64,13 +327,13 @@ int main() {
  
     std::cout << buffer;
     std::getline(std::cin, username);
-    send(client_socket, username.c_str(), username.size(), 0);
+    send_line(client_socket, username + "\n");
 
     memset(buffer, 0, BUFFER_SIZE);
     recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the password" for the server
     std::cout << buffer;
     std::getline(std::cin, password);
-    send(client_socket, password.c_str(), password.size(), 0);
+    send_line(client_socket, password + "\n");
 
     memset(buffer, 0, BUFFER_SIZE);
     // Depending on whether the authentication passes or not, receive the message "Authentication Failed" or "Welcome to the server"
@@ -82,10 +345,21 @@ int main() {
         return 1;
     }
 
+    // Let the server detect a dead client quickly; pings are answered by the receive thread
+    send_line(client_socket, "/heartbeat\n");
+
+    // Ask only for what arrived since the cached messages
+    if (!cache.open(username)) {
+        std::cerr << "Message cache unavailable, starting without it." << std::endl;
+    }
+    send_line(client_socket, "/sync " + std::to_string(cache.last_seq()) + "\n");
+
     // Start thread for receiving messages from server
     std::thread receive_thread(handle_server_messages, client_socket);
     // We use detach because we want this thread to run in the background while the main thread continues running
     receive_thread.detach();
+    std::thread probe_thread(probe_latency, client_socket);
+    probe_thread.detach();
 
     // Send messages to the server
     while (true) {
@@ -94,7 +368,31 @@ int main() {
 
         if (message.empty()) continue;
 
-        send(client_socket, message.c_str(), message.size(), 0);
+        // "/recent [filter]" is answered from the local cache
+        if (message.compare(0, 7, "/recent") == 0) {
+            std::string filter = message.size() > 8 ? message.substr(8) : "";
+            std::lock_guard<std::mutex> lock(cout_mutex);
+            for (const std::string& text : cache.recent(filter, RECENT_DEFAULT)) {
+                std::cout << text;
+            }
+            continue;
+        }
+
+        // "/latency" probes once, "/latency <seconds>" keeps probing, "/latency off" stops
+        if (message.compare(0, 8, "/latency") == 0) {
+            std::string arg = message.size() > 9 ? message.substr(9) : "";
+            if (arg.empty()) {
+                send_probe(client_socket);
+            } else if (arg == "off") {
+                latency_interval = 0;
+            } else {
+                latency_interval = std::max(1, atoi(arg.c_str()));
+            }
+            continue;
+        }
+
+        // The server frames commands by newline
+        send_line(client_socket, message + "\n");
 
         if (message == "/exit") {
             close(client_socket);
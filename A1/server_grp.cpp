@@ -6,25 +6,94 @@
 #include "server_grp.h"
 #include <algorithm>
 #include <arpa/inet.h>
+#include <array>
+#include <chrono>
 #include <cstring>
+#include <dirent.h>
 #include <fcntl.h>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <sstream>
 #include <stdexcept>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <vector>
+#include <zlib.h>
 
 #define PORT "12345"            // Port we're listening on
+#define ADMIN_SOCKET "admin.sock" // Admin Unix socket, owner-only (0600)
+#define IMPORT_DIR "import"       // Directory admin imports are read from
+#define WS_PORT "12347"         // WebSocket port for browser clients
 #define FILENAME "users.txt"    // File to read user credentials from
-constexpr int MAX_EVENTS = 100; // Maximum number of events to handle at once
+#define GATEWAYS_FILE "gateways.txt" // File to read gateway credentials from
+constexpr size_t GATEWAY_SECRET_MIN = 16; // Shortest gateway secret accepted
+constexpr size_t GATEWAY_SID_MAX = 64;    // Longest gateway session id
+constexpr int MIN_EVENTS = 16;   // Smallest epoll batch the loop shrinks to
+constexpr int MAX_EVENTS = 1024; // Largest epoll batch the loop grows to
+constexpr int SHRINK_AFTER = 64; // Quiet iterations before the batch shrinks
 constexpr int BUF_SIZE = 1024;  // Buffer size for client data
+constexpr int64_t HEARTBEAT_INTERVAL_MS = 5000; // Idle time before a ping
+constexpr int64_t HEARTBEAT_TIMEOUT_MS = 3000;  // Time allowed for the pong
+constexpr int64_t DEDUP_WINDOW_MS = 5000; // Repeats within this are dropped where /dedup is on
+constexpr int64_t IDEMPOTENCY_WINDOW_MS = 60000; // How long /idem keys are remembered
+constexpr size_t EPHEMERAL_BACKLOG_LIMIT = 16384; // Unsent bytes above which events are dropped
+constexpr size_t STATUS_MAX = 128;                // Longest /status text
+constexpr size_t OUTQUEUE_LIMIT = 4 << 20; // Queued bytes above which bulk traffic is dropped
+constexpr size_t MAX_MESSAGE_SIZE = 1 << 20; // Longest command line accepted
+constexpr size_t STREAM_THRESHOLD = BUF_SIZE; // Unterminated bytes after which a message is streamed
+constexpr int64_t STREAM_IDLE_MS = 5000; // A stream silent this long is cut off
+constexpr int64_t STREAM_MAX_MS = 60000; // A stream still open after this is cut off
+constexpr int64_t STREAM_MIN_RATE = 4096; // Bytes per second a stream must average after STREAM_IDLE_MS
+constexpr size_t WS_MAX_MESSAGE = 65536; // Largest WebSocket message accepted
+constexpr size_t CREDIT_HOLD_LIMIT = 256; // Messages held per client waiting for credit
+constexpr size_t FANOUT_QUANTUM = 32;   // Recipients per round per unit of QoS weight
+constexpr size_t FANOUT_BUDGET = 8192;  // Recipients served per event loop iteration
+constexpr size_t LOGIN_BATCH = 512;     // Logins checked per event loop iteration
+constexpr int64_t ACTIVE_READER_MS = 60000; // Members who sent a command this recently are reading
+constexpr size_t PULL_MIN_MEMBERS = 1024; // Online members before a group may switch to pull delivery
+constexpr double PULL_ENTER_RATE = 0.05; // Share of members reading below which a group pulls
+constexpr double PULL_EXIT_RATE = 0.20;  // Share of members reading above which it pushes again
+constexpr double READ_RATE_WINDOW = 32;  // Messages the read rate is averaged over
+constexpr size_t DIGEST_MESSAGES = 50;  // Default messages per digest
+constexpr size_t DIGEST_MAX_MESSAGES = 1000; // Largest messages-per-digest a user may ask for
+constexpr size_t DIGEST_MAX_BYTES = 256 << 10; // Text bytes after which a digest is sent early
+constexpr int64_t DIGEST_MAX_SECONDS = 86400; // Longest digest interval
+constexpr size_t MAX_SCHEDULED_PER_USER = 100; // Pending scheduled messages per user
+constexpr int64_t MAX_SCHEDULE_AHEAD_MS = 366 * 86400 * 1000LL; // Furthest a message can be scheduled
+constexpr uint64_t SEGMENT_BYTES = 4 << 20; // Journal segment size before rotation
+constexpr uint32_t RECORD_MAGIC = 0x4a524e4c; // "JRNL"
+constexpr size_t HOT_PER_CONVERSATION = 256; // Messages kept in memory per conversation
+constexpr size_t SYNC_LIMIT = 500;      // Records replayed per /sync request
+constexpr int64_t JOURNAL_SYNC_MS = 1000; // Interval between journal fdatasync calls
+constexpr uint64_t HISTORY_INDEX_STRIDE = 32; // Messages per sparse index entry
+constexpr size_t HISTORY_DEFAULT = 20;  // Messages per /history page by default
+constexpr size_t HISTORY_MAX = 200;     // Largest /history page
+constexpr size_t WARM_SEGMENTS = 2;     // Sealed segments kept uncompressed for sendfile()
+constexpr int64_t COMPACT_INTERVAL_MS = 60000; // Interval between compaction passes
+constexpr int64_t RECOMPACT_MS = 600000; // Minimum time between retention passes over an archive
+constexpr size_t ARCHIVE_BLOCK_BYTES = 64 << 10; // Uncompressed bytes per archive block
+constexpr uint32_t ARCHIVE_MAGIC = 0x4352414a; // "JARC"
+constexpr int KEEPALIVE_IDLE = 5;     // TCP keepalive: idle seconds before probing
+constexpr int KEEPALIVE_INTERVAL = 2; // TCP keepalive: seconds between probes
+constexpr int KEEPALIVE_COUNT = 3;    // TCP keepalive: unanswered probes allowed
+constexpr unsigned USER_TIMEOUT_MS = 10000; // Max time sent data may stay unacked
 #define DEBUG 0                 // Debug flag
 
 /**
@@ -32,6 +101,7 @@ constexpr int BUF_SIZE = 1024;  // Buffer size for client data
  */
 void sigint_handler(int signo) {
   std::cout << "\nShutting down server ..." << std::endl;
+  unlink(ADMIN_SOCKET);
   exit(0);
 }
 
@@ -57,241 +127,3988 @@ void strip_input(std::string &str) {
       str.end());
 }
 
+/**
+ * Current time on the monotonic clock in milliseconds
+ */
+int64_t now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * 64-bit FNV-1a fingerprint of a string
+ * @param data: bytes to hash
+ * @param seed: previous fingerprint, to chain several fields
+ */
+uint64_t fingerprint(const std::string &data,
+                     uint64_t seed = 14695981039346656037ULL) {
+  uint64_t hash = seed;
+  for (unsigned char ch : data) {
+    hash ^= ch;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * Hash identifying a user in mute lists and the in-memory history
+ * @param username: user name
+ * @return: never 0, which stands for "no sender"
+ */
+uint64_t user_hash(const std::string &username) {
+  return fingerprint(username) | 1;
+}
+
+/**
+ * Check a fingerprint against the ring and record it
+ * @param fingerprint: fingerprint of the message
+ * @param now_ms: current time in milliseconds
+ * @param window_ms: how long the fingerprint stays remembered
+ * @return: true if the fingerprint was seen within its window
+ */
+bool DuplicateFilter::seen(uint64_t fingerprint, int64_t now_ms,
+                           int64_t window_ms) {
+  for (const Slot &slot : ring) {
+    if (slot.fingerprint == fingerprint && slot.expires > now_ms)
+      return true;
+  }
+  ring[next] = Slot{fingerprint, now_ms + window_ms};
+  next = (next + 1) % DEDUP_RING;
+  return false;
+}
+
+void IdempotencyKeys::expire(int64_t now_ms) {
+  while (!order.empty() &&
+         (order.front().first <= now_ms || order.size() > MAX_KEYS)) {
+    auto it = expires.find(order.front().second);
+    if (it != expires.end() && it->second == order.front().first)
+      expires.erase(it);
+    order.pop_front();
+  }
+}
+
+bool IdempotencyKeys::seen(uint64_t key, int64_t now_ms) {
+  expire(now_ms);
+  return expires.count(key) > 0;
+}
+
+void IdempotencyKeys::record(uint64_t key, int64_t now_ms, int64_t window_ms) {
+  expires[key] = now_ms + window_ms;
+  order.emplace_back(now_ms + window_ms, key);
+  expire(now_ms);
+}
+
+void MuteList::add(uint64_t hash, const std::string &username, bool block) {
+  exact[hash] = Entry{username, block};
+  bloom[(hash & 0xff) >> 6] |= 1ULL << (hash & 63);
+  bloom[((hash >> 32) & 0xff) >> 6] |= 1ULL << ((hash >> 32) & 63);
+}
+
+bool MuteList::remove(uint64_t hash) {
+  if (exact.erase(hash) == 0)
+    return false;
+  // Bloom filters cannot forget, so start over from the exact entries.
+  std::fill(std::begin(bloom), std::end(bloom), 0);
+  for (const auto &entry : exact)
+    add(entry.first, entry.second.username, entry.second.block);
+  return true;
+}
+
+bool MuteList::maybe(uint64_t hash) const {
+  return (bloom[(hash & 0xff) >> 6] & (1ULL << (hash & 63))) &&
+         (bloom[((hash >> 32) & 0xff) >> 6] & (1ULL << ((hash >> 32) & 63)));
+}
+
+/**
+ * Whether messages from a user are hidden
+ * @param hash: sender's user_hash()
+ */
+bool MuteList::mutes(uint64_t hash) const {
+  return maybe(hash) && exact.count(hash) > 0;
+}
+
+/**
+ * Whether direct messages from a user are refused
+ * @param hash: sender's user_hash()
+ */
+bool MuteList::blocks(uint64_t hash) const {
+  if (!maybe(hash))
+    return false;
+  auto it = exact.find(hash);
+  return it != exact.end() && it->second.block;
+}
+
+std::vector<std::string> MuteList::names(bool blocked) const {
+  std::vector<std::string> result;
+  for (const auto &entry : exact) {
+    if (entry.second.block == blocked)
+      result.push_back(entry.second.username);
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+/**
+ * Index of the chunk that holds, or would hold, a name
+ * @param name: name to look up
+ */
+size_t SortedListing::locate(const std::string &name) const {
+  auto it = std::upper_bound(
+      chunks.begin(), chunks.end(), name,
+      [](const std::string &n, const Chunk &c) { return n < c.names.front(); });
+  return it == chunks.begin() ? 0 : static_cast<size_t>(it - chunks.begin()) - 1;
+}
+
+void SortedListing::insert(const std::string &name) {
+  if (chunks.empty()) {
+    chunks.emplace_back();
+    chunks.back().names.push_back(name);
+    ++count;
+    return;
+  }
+  Chunk &chunk = chunks[locate(name)];
+  auto pos = std::lower_bound(chunk.names.begin(), chunk.names.end(), name);
+  if (pos != chunk.names.end() && *pos == name)
+    return;
+  chunk.names.insert(pos, name);
+  chunk.encoded.reset();
+  ++count;
+  if (chunk.names.size() <= 2 * CHUNK)
+    return;
+  // Split; both halves are re-encoded on their next request.
+  size_t index = &chunk - chunks.data();
+  Chunk upper;
+  upper.names.assign(chunk.names.begin() + CHUNK, chunk.names.end());
+  chunk.names.resize(CHUNK);
+  chunks.insert(chunks.begin() + index + 1, std::move(upper));
+}
+
+void SortedListing::erase(const std::string &name) {
+  if (chunks.empty())
+    return;
+  size_t index = locate(name);
+  Chunk &chunk = chunks[index];
+  auto pos = std::lower_bound(chunk.names.begin(), chunk.names.end(), name);
+  if (pos == chunk.names.end() || *pos != name)
+    return;
+  chunk.names.erase(pos);
+  chunk.encoded.reset();
+  --count;
+  if (chunk.names.empty()) {
+    chunks.erase(chunks.begin() + index);
+    return;
+  }
+  // Merge small neighbours so churn does not leave many tiny chunks.
+  if (index + 1 < chunks.size() &&
+      chunk.names.size() + chunks[index + 1].names.size() <= CHUNK) {
+    Chunk &next = chunks[index + 1];
+    chunk.names.insert(chunk.names.end(), next.names.begin(), next.names.end());
+    chunks.erase(chunks.begin() + index + 1);
+  }
+}
+
+/**
+ * Page of names
+ * @param prefix: only names starting with this
+ * @param after: only names sorting after this (empty = from the start)
+ * @param last: set to the last name of the page
+ * @param more: set if matching names follow the page
+ * A page is the rest of one chunk; a page covering a whole chunk is the
+ * chunk's cached buffer, shared by every request for it.
+ */
+std::shared_ptr<const std::string>
+SortedListing::page(const std::string &prefix, const std::string &after,
+                    std::string &last, bool &more) {
+  static const auto none = std::make_shared<const std::string>();
+  last.clear();
+  more = false;
+  if (chunks.empty())
+    return none;
+  auto matches = [&prefix](const std::string &name) {
+    return name.compare(0, prefix.size(), prefix) == 0;
+  };
+  bool exclusive = !after.empty() && after >= prefix;
+  const std::string &from = exclusive ? after : prefix;
+  size_t index = locate(from);
+  const std::vector<std::string> *names = &chunks[index].names;
+  auto start = exclusive
+                   ? std::upper_bound(names->begin(), names->end(), from)
+                   : std::lower_bound(names->begin(), names->end(), from);
+  if (start == names->end()) {
+    if (++index == chunks.size())
+      return none;
+    names = &chunks[index].names;
+    start = names->begin();
+  }
+  auto end = start;
+  while (end != names->end() && matches(*end))
+    ++end;
+  if (end == start)
+    return none;
+  last = *(end - 1);
+  more = end == names->end() && index + 1 < chunks.size() &&
+         matches(chunks[index + 1].names.front());
+
+  if (start == names->begin() && end == names->end() && chunks[index].encoded)
+    return chunks[index].encoded;
+  std::string text;
+  for (auto it = start; it != end; ++it)
+    text += *it + "\n";
+  auto buf = std::make_shared<const std::string>(std::move(text));
+  if (start == names->begin() && end == names->end())
+    chunks[index].encoded = buf;
+  return buf;
+}
+
+HeavyHitters::HeavyHitters()
+    : countSketch(DEPTH * WIDTH, 0), byteSketch(DEPTH * WIDTH, 0) {}
+
+/**
+ * Add to every row of a sketch and return the new estimate
+ * @param sketch: DEPTH x WIDTH counters
+ * @param hash: fingerprint of the key
+ * @param amount: value to add
+ * @return: minimum over the rows, an upper bound on the true total
+ */
+uint64_t HeavyHitters::update(std::vector<uint64_t> &sketch, uint64_t hash,
+                              uint64_t amount) {
+  // Derive the row hashes from one fingerprint (Kirsch-Mitzenmacher).
+  uint64_t h1 = hash & 0xffffffffULL;
+  uint64_t h2 = (hash >> 32) | 1;
+  uint64_t estimate = UINT64_MAX;
+  for (size_t row = 0; row < DEPTH; ++row) {
+    uint64_t &cell = sketch[row * WIDTH + (h1 + row * h2) % WIDTH];
+    cell += amount;
+    estimate = std::min(estimate, cell);
+  }
+  return estimate;
+}
+
+/**
+ * Offer a key to a top-K min-heap
+ * @param heap: heap of candidates, smallest estimate at the front
+ * @param key: key that was just updated
+ * @param estimate: its new estimate
+ */
+void HeavyHitters::offer(std::vector<Candidate> &heap, const std::string &key,
+                         uint64_t estimate) {
+  auto greater = [](const Candidate &a, const Candidate &b) {
+    return a.estimate > b.estimate;
+  };
+  for (Candidate &c : heap) {
+    if (c.key == key) {
+      c.estimate = estimate;
+      std::make_heap(heap.begin(), heap.end(), greater);
+      return;
+    }
+  }
+  if (heap.size() < TOP_K) {
+    heap.push_back(Candidate{key, estimate});
+    std::push_heap(heap.begin(), heap.end(), greater);
+  } else if (estimate > heap.front().estimate) {
+    std::pop_heap(heap.begin(), heap.end(), greater);
+    heap.back() = Candidate{key, estimate};
+    std::push_heap(heap.begin(), heap.end(), greater);
+  }
+}
+
+/**
+ * Record one message for a key
+ * @param key: sender, group or recipient name
+ * @param bytes: payload size
+ */
+void HeavyHitters::record(const std::string &key, uint64_t bytes,
+                          uint64_t copies) {
+  if (copies == 0)
+    return;
+  uint64_t hash = fingerprint(key);
+  offer(topCount, key, update(countSketch, hash, copies));
+  offer(topBytes, key, update(byteSketch, hash, bytes * copies));
+}
+
+/**
+ * Current top keys, largest first
+ * @param by_bytes: rank by bytes instead of message count
+ */
+std::vector<std::pair<std::string, uint64_t>>
+HeavyHitters::top(bool by_bytes) const {
+  const std::vector<Candidate> &heap = by_bytes ? topBytes : topCount;
+  std::vector<std::pair<std::string, uint64_t>> result;
+  for (const Candidate &c : heap)
+    result.emplace_back(c.key, c.estimate);
+  std::sort(result.begin(), result.end(),
+            [](const auto &a, const auto &b) { return a.second > b.second; });
+  return result;
+}
+
+/**
+ * CRC-32 (IEEE) lookup table, built at compile time so the parallel
+ * segment loaders share it without any initialisation race
+ */
+constexpr std::array<uint32_t, 256> make_crc_table() {
+  std::array<uint32_t, 256> table = {};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; ++k)
+      c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    table[i] = c;
+  }
+  return table;
+}
+constexpr std::array<uint32_t, 256> CRC_TABLE = make_crc_table();
+
+/**
+ * CRC-32 (IEEE) of a byte range
+ * @param data: bytes
+ * @param len: number of bytes
+ * @param crc: running CRC, to continue over several ranges
+ */
+uint32_t crc32(const void *data, size_t len, uint32_t crc = 0) {
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  crc = ~crc;
+  for (size_t i = 0; i < len; ++i)
+    crc = CRC_TABLE[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+/**
+ * Wall-clock time in milliseconds since the epoch
+ */
+int64_t unix_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * Wall-clock time in microseconds since the epoch
+ */
+int64_t unix_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * Conversation key of a direct message
+ * @param a: one participant
+ * @param b: the other participant
+ */
+std::string dm_key(const std::string &a, const std::string &b) {
+  return "d:" + std::min(a, b) + "|" + std::max(a, b);
+}
+
+/**
+ * Whether user input contains control bytes
+ * @param text: command, name or message text
+ * Everything below ' ' except tab, and DEL, counts. User input must not
+ * carry them: '\x1e' starts a tagged record for /sync clients and '\n'
+ * ends a line, so either could be taken for server framing.
+ */
+bool has_control_bytes(const std::string &text) {
+  return std::any_of(text.begin(), text.end(), [](unsigned char ch) {
+    return (ch < 0x20 && ch != '\t') || ch == 0x7f;
+  });
+}
+
+/**
+ * Whether a name can be used for a group
+ * @param name: proposed group name
+ * Group names share the fanout key space with "*" (broadcasts) and
+ * "!<channel>" (channels), so they may not contain '*' or '!', nor control
+ * bytes.
+ */
+bool valid_group_name(const std::string &name) {
+  return !name.empty() && name.find_first_of("*!") == std::string::npos &&
+         !has_control_bytes(name);
+}
+
+/**
+ * Sequence-tagged record as sent to /sync clients
+ * @param seq: journal sequence number
+ * @param key: conversation key
+ * @param text: rendered message
+ * Framed as "\x1e<seq> <key> <length>\n<text>". Commands with control
+ * bytes are refused (has_control_bytes()), so user-chosen text cannot
+ * contain the record separator, and clients only take it as the start of
+ * a record at the start of a line.
+ */
+std::string tag_record(uint64_t seq, const std::string &key,
+                       const std::string &text) {
+  return "\x1e" + std::to_string(seq) + " " + key + " " +
+         std::to_string(text.size()) + "\n" + text;
+}
+
+SegmentFile::~SegmentFile() { close(fd); }
+
+/**
+ * Archive file layout: an ArchiveHeader, a table of ArchiveBlock entries,
+ * then the zlib-compressed blocks. Each block holds whole journal records,
+ * byte for byte, so their CRCs still hold; record offsets in an archived
+ * segment are offsets into the uncompressed record stream.
+ */
+struct ArchiveHeader {
+  uint32_t magic;
+  uint32_t blocks;
+  uint64_t rawSize;
+};
+
+struct ArchiveBlock {
+  uint64_t rawOffset; // offset of the block in the record stream
+  uint32_t rawLen;
+  uint32_t compLen;
+  uint64_t fileOffset;
+  uint64_t firstSeq;
+};
+
+/**
+ * Length of the well-formed records at the start of a buffer
+ * @param data: records
+ * @param size: buffer size
+ * @param check_crc: also verify each record's CRC
+ */
+size_t valid_records(const char *data, size_t size, bool check_crc) {
+  size_t offset = 0;
+  while (offset + sizeof(RecordHeader) <= size) {
+    RecordHeader header;
+    memcpy(&header, data + offset, sizeof(header));
+    if (header.magic != RECORD_MAGIC || header.length < sizeof(header) ||
+        offset + header.length > size ||
+        record_text_offset(header) > header.length ||
+        (check_crc &&
+         crc32(data + offset + 12, header.length - 12) != header.crc))
+      break;
+    offset += header.length;
+  }
+  return offset;
+}
+
+/**
+ * Read an archive block by block
+ * @param path: archive file
+ * @param from: skip blocks that end before this record stream offset
+ * @param visit: called with each uncompressed block and its offset in the
+ *               record stream; return false to stop
+ * @return: false if the archive is unreadable or damaged
+ */
+bool read_archive(
+    const std::string &path, uint64_t from,
+    const std::function<bool(const char *, size_t, uint64_t)> &visit) {
+  int arc_fd = ::open(path.c_str(), O_RDONLY);
+  if (arc_fd == -1)
+    return false;
+  struct stat st;
+  fstat(arc_fd, &st);
+  size_t size = st.st_size;
+  void *map = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_SHARED, arc_fd, 0)
+                       : MAP_FAILED;
+  close(arc_fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  const char *data = static_cast<const char *>(map);
+  bool ok = size >= sizeof(ArchiveHeader);
+  ArchiveHeader header = {};
+  if (ok) {
+    memcpy(&header, data, sizeof(header));
+    ok = header.magic == ARCHIVE_MAGIC &&
+         sizeof(header) + header.blocks * sizeof(ArchiveBlock) <= size;
+  }
+  std::string raw;
+  for (uint32_t i = 0; ok && i < header.blocks; ++i) {
+    ArchiveBlock block;
+    memcpy(&block, data + sizeof(header) + i * sizeof(block), sizeof(block));
+    if (block.rawOffset + block.rawLen <= from)
+      continue;
+    if (block.fileOffset + block.compLen > size) {
+      ok = false;
+      break;
+    }
+    raw.resize(block.rawLen);
+    uLongf len = block.rawLen;
+    if (uncompress(reinterpret_cast<Bytef *>(&raw[0]), &len,
+                   reinterpret_cast<const Bytef *>(data + block.fileOffset),
+                   block.compLen) != Z_OK ||
+        len != block.rawLen) {
+      ok = false;
+      break;
+    }
+    if (!visit(raw.data(), raw.size(), block.rawOffset))
+      break;
+  }
+  munmap(map, size);
+  return ok;
+}
+
+/**
+ * Write records as a compressed archive
+ * @param path: file to create
+ * @param records: well-formed journal records
+ * @return: false on I/O errors
+ * Blocks are cut at record boundaries once they reach ARCHIVE_BLOCK_BYTES.
+ * The file is fsynced before returning.
+ */
+bool write_archive(const std::string &path, const std::string &records) {
+  std::vector<ArchiveBlock> blocks;
+  size_t offset = 0;
+  while (offset < records.size()) {
+    ArchiveBlock block = {};
+    block.rawOffset = offset;
+    memcpy(&block.firstSeq,
+           records.data() + offset + offsetof(RecordHeader, seq),
+           sizeof(block.firstSeq));
+    while (offset < records.size() &&
+           offset - block.rawOffset < ARCHIVE_BLOCK_BYTES) {
+      uint32_t length;
+      memcpy(&length, records.data() + offset + offsetof(RecordHeader, length),
+             sizeof(length));
+      offset += length;
+    }
+    block.rawLen = offset - block.rawOffset;
+    blocks.push_back(block);
+  }
+
+  std::string body;
+  uint64_t file_offset =
+      sizeof(ArchiveHeader) + blocks.size() * sizeof(ArchiveBlock);
+  for (ArchiveBlock &block : blocks) {
+    uLongf len = compressBound(block.rawLen);
+    std::string packed(len, '\0');
+    if (compress2(reinterpret_cast<Bytef *>(&packed[0]), &len,
+                  reinterpret_cast<const Bytef *>(records.data() +
+                                                  block.rawOffset),
+                  block.rawLen, Z_DEFAULT_COMPRESSION) != Z_OK)
+      return false;
+    block.compLen = len;
+    block.fileOffset = file_offset;
+    file_offset += len;
+    body.append(packed, 0, len);
+  }
+
+  ArchiveHeader header = {ARCHIVE_MAGIC, static_cast<uint32_t>(blocks.size()),
+                          records.size()};
+  std::string file(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.append(reinterpret_cast<const char *>(blocks.data()),
+              blocks.size() * sizeof(ArchiveBlock));
+  file += body;
+
+  int out = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out == -1)
+    return false;
+  size_t written = 0;
+  while (written < file.size()) {
+    ssize_t n = write(out, file.data() + written, file.size() - written);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    written += n;
+  }
+  bool ok = written == file.size() && fsync(out) == 0;
+  close(out);
+  return ok;
+}
+
+/**
+ * Segment read back during recovery
+ */
+struct LoadedSegment {
+  std::string data;   // records, decompressed for archives
+  size_t valid = 0;   // length of the records with a good CRC
+  bool intact = true; // false if an archive could not be decompressed
+};
+
+/**
+ * Load and check a segment
+ * @param path: segment or archive file
+ * @param archive: path is a compressed archive
+ * Runs on a recovery thread; touches nothing but the file.
+ */
+LoadedSegment load_segment(const std::string &path, bool archive) {
+  LoadedSegment loaded;
+  if (archive) {
+    loaded.intact = read_archive(
+        path, 0, [&loaded](const char *data, size_t size, uint64_t) {
+          loaded.data.append(data, size);
+          return true;
+        });
+  } else {
+    std::ifstream in(path, std::ios::binary);
+    loaded.data.assign(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+  }
+  loaded.valid = valid_records(loaded.data.data(), loaded.data.size(), true);
+  return loaded;
+}
+
+Journal::~Journal() {
+  if (fd != -1) {
+    fdatasync(fd);
+    close(fd);
+  }
+}
+
+std::string Journal::segment_path(uint32_t index) const {
+  char name[32];
+  snprintf(name, sizeof(name), "/segment-%08u.log", index);
+  return dir + name;
+}
+
+std::string Journal::archive_path(uint32_t index) const {
+  char name[32];
+  snprintf(name, sizeof(name), "/archive-%08u.z", index);
+  return dir + name;
+}
+
+void Journal::open_segment(uint32_t index) {
+  if (fd != -1)
+    close(fd);
+  fd = ::open(segment_path(index).c_str(), O_WRONLY | O_CREAT | O_APPEND,
+              0644);
+  if (fd == -1) {
+    throw std::runtime_error("cannot open journal segment " +
+                             segment_path(index));
+  }
+  struct stat st;
+  fstat(fd, &st);
+  activeSegment = index;
+  activeSize = st.st_size;
+  if (segments.empty() || segments.back() != index)
+    segments.push_back(index);
+}
+
+/**
+ * Open the journal
+ * @param replay: called for every valid record, in sequence order
+ * Scans the existing segments and archives, truncates a torn tail in the
+ * last segment, and continues appending to it. Segments are loaded and
+ * checksummed in parallel; records are replayed in order. Leftovers of an
+ * interrupted compaction are cleaned up first: a half-written archive is
+ * deleted, and a segment whose archive was already installed is removed.
+ */
+void Journal::open(const std::function<void(const JournalRecord &)> &replay) {
+  mkdir(dir.c_str(), 0755);
+
+  segments.clear();
+  archives.clear();
+  std::vector<uint32_t> raw;
+  if (DIR *d = opendir(dir.c_str())) {
+    while (struct dirent *entry = readdir(d)) {
+      std::string name = entry->d_name;
+      unsigned index;
+      if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0)
+        unlink((dir + "/" + name).c_str());
+      else if (sscanf(entry->d_name, "segment-%8u.log", &index) == 1)
+        raw.push_back(index);
+      else if (sscanf(entry->d_name, "archive-%8u.z", &index) == 1)
+        archives.insert(index);
+    }
+    closedir(d);
+  }
+  for (uint32_t index : raw) {
+    if (archives.count(index) > 0)
+      unlink(segment_path(index).c_str());
+    else
+      segments.push_back(index);
+  }
+  segments.insert(segments.end(), archives.begin(), archives.end());
+  std::sort(segments.begin(), segments.end());
+
+  // Reading, decompressing and checksumming run on worker threads, up to
+  // one segment per core ahead of the replay, which applies the records
+  // in journal order.
+  size_t window = std::max(1u, std::thread::hardware_concurrency());
+  std::deque<std::future<LoadedSegment>> loading;
+  size_t next = 0;
+  for (size_t i = 0; i < segments.size(); ++i) {
+    for (; next < segments.size() && next < i + window; ++next) {
+      bool archive = archived(segments[next]);
+      loading.push_back(std::async(
+          std::launch::async, load_segment,
+          archive ? archive_path(segments[next]) : segment_path(segments[next]),
+          archive));
+    }
+    LoadedSegment loaded = loading.front().get();
+    loading.pop_front();
+
+    const char *data = loaded.data.data();
+    for (size_t offset = 0; offset < loaded.valid;) {
+      RecordHeader header;
+      memcpy(&header, data + offset, sizeof(header));
+      JournalRecord record;
+      record.seq = header.seq;
+      record.time = header.time;
+      record.kind = static_cast<RecordKind>(header.kind);
+      record.key.assign(data + offset + sizeof(header), header.keyLen);
+      if (header.flags & RECORD_HAS_SENDER)
+        memcpy(&record.sender,
+               data + offset + sizeof(header) + header.keyLen,
+               sizeof(record.sender));
+      record.text.assign(data + offset + record_text_offset(header),
+                         header.length - record_text_offset(header));
+      record.segment = segments[i];
+      record.offset = offset;
+      lastSeq = std::max(lastSeq, record.seq);
+      replay(record);
+      offset += header.length;
+    }
+
+    if (archived(segments[i])) {
+      if (!loaded.intact || loaded.valid != loaded.data.size())
+        std::cerr << "journal: " << archive_path(segments[i]) << " damaged"
+                  << std::endl;
+      continue;
+    }
+    if (loaded.valid != loaded.data.size()) {
+      std::string path = segment_path(segments[i]);
+      std::cerr << "journal: " << path << " damaged at offset "
+                << loaded.valid;
+      if (i + 1 == segments.size()) {
+        // Torn write from an unclean stop: drop the partial record.
+        std::cerr << ", truncating" << std::endl;
+        if (truncate(path.c_str(), loaded.valid) == -1)
+          perror("truncate");
+      } else {
+        std::cerr << ", skipping the rest of the segment" << std::endl;
+      }
+    }
+  }
+
+  if (segments.empty())
+    open_segment(0);
+  else
+    open_segment(archived(segments.back()) ? segments.back() + 1
+                                           : segments.back());
+}
+
+/**
+ * Append a record
+ * @param kind: record kind
+ * @param key: conversation or group key
+ * @param text: rendered message or username
+ * @return: the record's sequence number
+ */
+uint64_t Journal::append(RecordKind kind, const std::string &key,
+                         const std::string &text, uint64_t sender) {
+  RecordHeader header = {};
+  header.magic = RECORD_MAGIC;
+  header.kind = static_cast<uint8_t>(kind);
+  header.flags = sender != 0 ? RECORD_HAS_SENDER : 0;
+  header.keyLen = key.size();
+  header.length = record_text_offset(header) + text.size();
+  header.seq = ++lastSeq;
+  header.time = unix_ms();
+
+  if (activeSize > 0 && activeSize + header.length > SEGMENT_BYTES)
+    open_segment(activeSegment + 1);
+
+  lastLocation = RecordLocation{activeSegment, activeSize};
+  std::string record(reinterpret_cast<const char *>(&header), sizeof(header));
+  record += key;
+  if (sender != 0)
+    record.append(reinterpret_cast<const char *>(&sender), sizeof(sender));
+  record += text;
+  header.crc = crc32(record.data() + 12, record.size() - 12);
+  memcpy(&record[8], &header.crc, sizeof(header.crc));
+
+  size_t written = 0;
+  while (written < record.size()) {
+    ssize_t n = write(fd, record.data() + written, record.size() - written);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("journal write");
+      break;
+    }
+    written += n;
+  }
+  activeSize += written;
+  dirty = true;
+  return header.seq;
+}
+
+/**
+ * Walk records in journal order
+ * @param from: location of the first record to visit
+ * @param visit: called with each record's header, a pointer to its key
+ *               (followed by its text) and its location; return false to stop
+ * Segments are mapped read-only, so only the headers and keys that are
+ * looked at are read. Archived segments are decompressed a block at a
+ * time, starting with the block that holds from.
+ */
+void Journal::scan(
+    RecordLocation from,
+    const std::function<bool(const RecordHeader &, const char *, RecordLocation)>
+        &visit) const {
+  for (uint32_t index : segments) {
+    if (index < from.segment)
+      continue;
+    uint64_t start = index == from.segment ? from.offset : 0;
+    bool more = true;
+    auto walk = [&](const char *data, size_t size, uint64_t base) {
+      uint64_t offset = start > base ? start - base : 0;
+      while (more && offset + sizeof(RecordHeader) <= size) {
+        RecordHeader header;
+        memcpy(&header, data + offset, sizeof(header));
+        if (header.magic != RECORD_MAGIC || header.length < sizeof(header) ||
+            offset + header.length > size)
+          break;
+        more = visit(header, data + offset + sizeof(header),
+                     RecordLocation{index, base + offset});
+        offset += header.length;
+      }
+      return more;
+    };
+
+    if (archived(index)) {
+      read_archive(archive_path(index), start, walk);
+    } else {
+      int seg_fd = ::open(segment_path(index).c_str(), O_RDONLY);
+      if (seg_fd == -1)
+        continue;
+      struct stat st;
+      fstat(seg_fd, &st);
+      size_t size = st.st_size;
+      void *map = size > 0
+                      ? mmap(nullptr, size, PROT_READ, MAP_SHARED, seg_fd, 0)
+                      : MAP_FAILED;
+      close(seg_fd);
+      if (map == MAP_FAILED)
+        continue;
+      walk(static_cast<const char *>(map), size, 0);
+      munmap(map, size);
+    }
+    if (!more)
+      return;
+  }
+}
+
+/**
+ * Read-only handle on a segment, for sendfile()
+ * @param index: segment index
+ * @return: nullptr for archived segments, which are compressed
+ */
+std::shared_ptr<SegmentFile> Journal::segment_file(uint32_t index) {
+  if (archived(index))
+    return nullptr;
+  auto it = readers.find(index);
+  if (it != readers.end())
+    return it->second;
+  int seg_fd = ::open(segment_path(index).c_str(), O_RDONLY);
+  if (seg_fd == -1)
+    return nullptr;
+  auto file = std::make_shared<SegmentFile>(seg_fd);
+  readers[index] = file;
+  return file;
+}
+
+/**
+ * Uncompressed segments that are no longer appended to, oldest first
+ */
+std::vector<uint32_t> Journal::sealed_segments() const {
+  std::vector<uint32_t> sealed;
+  for (uint32_t index : segments) {
+    if (index != activeSegment && !archived(index))
+      sealed.push_back(index);
+  }
+  return sealed;
+}
+
+/**
+ * Archived segments, oldest first
+ */
+std::vector<uint32_t> Journal::archived_segments() const {
+  std::vector<uint32_t> result;
+  for (uint32_t index : segments) {
+    if (archived(index))
+      result.push_back(index);
+  }
+  return result;
+}
+
+/**
+ * Install a compacted segment
+ * @param index: segment index
+ * @param empty: every record expired; the segment is dropped altogether
+ * The new archive was written next to its final name with a ".tmp"
+ * suffix; renaming it replaces the previous archive atomically. Queued
+ * sendfile() output keeps the old segment file open until it is sent.
+ */
+void Journal::install_archive(uint32_t index, bool empty) {
+  std::string archive = archive_path(index);
+  readers.erase(index);
+  if (empty) {
+    unlink((archive + ".tmp").c_str());
+    unlink(archive.c_str());
+    archives.erase(index);
+    segments.erase(std::remove(segments.begin(), segments.end(), index),
+                   segments.end());
+  } else {
+    if (rename((archive + ".tmp").c_str(), archive.c_str()) == -1) {
+      perror("journal: rename archive");
+      return;
+    }
+    archives.insert(index);
+  }
+  unlink(segment_path(index).c_str());
+}
+
+/**
+ * Flush appended records to disk
+ */
+void Journal::sync() {
+  if (dirty && fd != -1) {
+    fdatasync(fd);
+    dirty = false;
+  }
+}
+
+/**
+ * Compact one segment
+ * @param job: segment to rewrite and the retention cutoffs to apply
+ * Runs on the compaction thread. Expired messages are dropped; all other
+ * records are copied unchanged. The archive is written to job.target with
+ * a ".tmp" suffix and installed by the event loop.
+ */
+CompactionResult compact_segment(const CompactionJob &job) {
+  CompactionResult result;
+  result.segment = job.segment;
+
+  std::string records;
+  if (job.fromArchive) {
+    bool ok = read_archive(job.source, 0,
+                           [&](const char *data, size_t size, uint64_t) {
+                             records.append(data, size);
+                             return true;
+                           });
+    if (!ok)
+      return result;
+  } else {
+    std::ifstream in(job.source, std::ios::binary);
+    if (!in)
+      return result;
+    records.assign(std::istreambuf_iterator<char>(in),
+                   std::istreambuf_iterator<char>());
+  }
+
+  std::string kept;
+  size_t valid = valid_records(records.data(), records.size(), false);
+  for (size_t offset = 0; offset < valid;) {
+    RecordHeader header;
+    memcpy(&header, records.data() + offset, sizeof(header));
+    bool drop = false;
+    if (header.kind == static_cast<uint8_t>(RecordKind::MESSAGE)) {
+      auto it = job.cutoffs.find(std::string(
+          records.data() + offset + sizeof(header), header.keyLen));
+      drop = it != job.cutoffs.end() && (header.seq < it->second.minSeq ||
+                                         header.time < it->second.minTime);
+      if (!drop)
+        result.remap[header.seq] = kept.size();
+    }
+    if (drop)
+      ++result.dropped;
+    else {
+      ++result.kept;
+      kept.append(records, offset, header.length);
+    }
+    offset += header.length;
+  }
+
+  result.empty = kept.empty();
+  result.ok = result.empty || write_archive(job.target + ".tmp", kept);
+  return result;
+}
+
+Compactor::Compactor() : notify_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+  if (notify_fd == -1)
+    throw std::runtime_error("eventfd failed");
+  worker = std::thread(&Compactor::work, this);
+}
+
+Compactor::~Compactor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  worker.join();
+  close(notify_fd);
+}
+
+/**
+ * Queue a compaction job
+ * @param job: segment to compact
+ */
+void Compactor::submit(CompactionJob job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(std::move(job));
+  }
+  wake.notify_one();
+}
+
+/**
+ * Take the finished jobs
+ * @return: results in completion order
+ */
+std::vector<CompactionResult> Compactor::take_results() {
+  uint64_t count;
+  while (read(notify_fd, &count, sizeof(count)) > 0) {
+  }
+  std::vector<CompactionResult> done;
+  std::lock_guard<std::mutex> lock(mutex);
+  done.swap(results);
+  return done;
+}
+
+void Compactor::work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+    if (stopping)
+      return;
+    CompactionJob job = std::move(jobs.front());
+    jobs.pop_front();
+    lock.unlock();
+    CompactionResult result = compact_segment(job);
+    lock.lock();
+    results.push_back(std::move(result));
+    uint64_t one = 1;
+    if (write(notify_fd, &one, sizeof(one)) == -1)
+      perror("compactor: eventfd");
+  }
+}
+
+/**
+ * Enable TCP keepalive probing on a client socket
+ * @param fd: client file descriptor
+ * The kernel then detects peers that vanished without a FIN, and
+ * TCP_USER_TIMEOUT drops connections whose sent data is never acknowledged.
+ */
+void enable_keepalive(int fd) {
+  int yes = 1;
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &KEEPALIVE_IDLE,
+             sizeof(KEEPALIVE_IDLE));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &KEEPALIVE_INTERVAL,
+             sizeof(KEEPALIVE_INTERVAL));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &KEEPALIVE_COUNT,
+             sizeof(KEEPALIVE_COUNT));
+  setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &USER_TIMEOUT_MS,
+             sizeof(USER_TIMEOUT_MS));
+}
+
+/**
+ * Ask the kernel to timestamp received data
+ * @param fd: client file descriptor
+ * recvmsg() then reports when the bytes arrived, so /ping replies include
+ * the time data waited in the socket before the server read it.
+ */
+void enable_rx_timestamps(int fd) {
+  int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+/**
+ * Schedule a callback on the wheel
+ * @param delay_ms: delay from now, rounded up to a whole tick
+ * @param fn: callback to run from the event loop
+ */
+void TimerWheel::schedule(int64_t delay_ms, std::function<void()> fn) {
+  int64_t ticks = std::max<int64_t>(1, (delay_ms + tickMs - 1) / tickMs);
+  int64_t due = currentTick + ticks;
+  wheel[due % wheel.size()].push_back(Entry{due, std::move(fn)});
+}
+
+/**
+ * Run every timer that expired up to now
+ * @param now_ms: current time in milliseconds
+ */
+void TimerWheel::advance(int64_t now_ms) {
+  int64_t target = now_ms / tickMs;
+  while (currentTick < target) {
+    ++currentTick;
+    std::vector<Entry> &slot = wheel[currentTick % wheel.size()];
+    if (slot.empty())
+      continue;
+
+    // Callbacks may schedule new timers, possibly into this very slot.
+    std::vector<Entry> due;
+    std::vector<Entry> pending;
+    for (Entry &e : slot) {
+      if (e.dueTick <= currentTick)
+        due.push_back(std::move(e));
+      else
+        pending.push_back(std::move(e));
+    }
+    slot.swap(pending);
+    for (Entry &e : due)
+      e.fn();
+  }
+}
+
+void ScheduleWheel::place(const Entry &entry) {
+  if (entry.dueSec <= current) {
+    ready.push_back(entry);
+    return;
+  }
+  // Lowest level whose slot range still holds both now and the due time.
+  for (int level = 0; level < LEVELS; ++level) {
+    int shift = SLOT_BITS * (level + 1);
+    if ((entry.dueSec >> shift) == (current >> shift)) {
+      int slot = (entry.dueSec >> (SLOT_BITS * level)) & ((1 << SLOT_BITS) - 1);
+      slots[level][slot].push_back(entry);
+      return;
+    }
+  }
+  overflow.push_back(entry);
+}
+
+/**
+ * Add a scheduled entry
+ * @param id: scheduled message id
+ * @param due_ms: unix time (ms) it is due; past times fire on the next advance
+ */
+void ScheduleWheel::add(uint64_t id, int64_t due_ms) {
+  place(Entry{id, (due_ms + 999) / 1000});
+}
+
+/**
+ * Advance to the current time
+ * @param now_ms: unix time (ms)
+ * @return: ids of the entries that became due, oldest first
+ */
+std::vector<uint64_t> ScheduleWheel::advance(int64_t now_ms) {
+  std::vector<Entry> due;
+  due.swap(ready);
+  int64_t target = now_ms / 1000;
+  while (current < target) {
+    ++current;
+    // Entering a new range at some level: move its entries down, top
+    // level first so they can fall through several levels at once.
+    std::vector<Entry> moving;
+    if ((current & ((1LL << (SLOT_BITS * LEVELS)) - 1)) == 0) {
+      moving.swap(overflow);
+      for (const Entry &entry : moving)
+        place(entry);
+    }
+    for (int level = LEVELS - 1; level > 0; --level) {
+      if ((current & ((1LL << (SLOT_BITS * level)) - 1)) != 0)
+        continue;
+      int slot = (current >> (SLOT_BITS * level)) & ((1 << SLOT_BITS) - 1);
+      moving.clear();
+      moving.swap(slots[level][slot]);
+      for (const Entry &entry : moving)
+        place(entry);
+    }
+
+    std::vector<Entry> &slot = slots[0][current & ((1 << SLOT_BITS) - 1)];
+    due.insert(due.end(), slot.begin(), slot.end());
+    slot.clear();
+    due.insert(due.end(), ready.begin(), ready.end());
+    ready.clear();
+  }
+  std::stable_sort(due.begin(), due.end(), [](const Entry &a, const Entry &b) {
+    return a.dueSec < b.dueSec;
+  });
+  std::vector<uint64_t> ids;
+  ids.reserve(due.size());
+  for (const Entry &entry : due)
+    ids.push_back(entry.id);
+  return ids;
+}
+
+/**
+ * SHA-1 digest, as needed by the WebSocket handshake
+ * @param data: bytes to hash
+ * @return: 20-byte binary digest
+ */
+std::string sha1(const std::string &data) {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                   0xC3D2E1F0};
+  std::string msg = data;
+  uint64_t bit_len = static_cast<uint64_t>(data.size()) * 8;
+  msg.push_back(static_cast<char>(0x80));
+  while (msg.size() % 64 != 56)
+    msg.push_back('\0');
+  for (int i = 7; i >= 0; --i)
+    msg.push_back(static_cast<char>((bit_len >> (i * 8)) & 0xff));
+
+  auto rol = [](uint32_t v, int n) { return (v << n) | (v >> (32 - n)); };
+  for (size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i) {
+      const unsigned char *b =
+          reinterpret_cast<const unsigned char *>(&msg[chunk + i * 4]);
+      w[i] = (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) |
+             (uint32_t(b[2]) << 8) | uint32_t(b[3]);
+    }
+    for (int i = 16; i < 80; ++i)
+      w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; ++i) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      uint32_t temp = rol(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rol(b, 30);
+      b = a;
+      a = temp;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  std::string digest;
+  for (uint32_t v : h)
+    for (int i = 3; i >= 0; --i)
+      digest.push_back(static_cast<char>((v >> (i * 8)) & 0xff));
+  return digest;
+}
+
+/**
+ * Base64 encode
+ * @param data: bytes to encode
+ */
+std::string base64_encode(const std::string &data) {
+  static const char table[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  size_t i = 0;
+  for (; i + 2 < data.size(); i += 3) {
+    uint32_t v = (uint8_t(data[i]) << 16) | (uint8_t(data[i + 1]) << 8) |
+                 uint8_t(data[i + 2]);
+    out.push_back(table[(v >> 18) & 63]);
+    out.push_back(table[(v >> 12) & 63]);
+    out.push_back(table[(v >> 6) & 63]);
+    out.push_back(table[v & 63]);
+  }
+  if (i < data.size()) {
+    uint32_t v = uint8_t(data[i]) << 16;
+    if (i + 1 < data.size())
+      v |= uint8_t(data[i + 1]) << 8;
+    out.push_back(table[(v >> 18) & 63]);
+    out.push_back(table[(v >> 12) & 63]);
+    out.push_back(i + 1 < data.size() ? table[(v >> 6) & 63] : '=');
+    out.push_back('=');
+  }
+  return out;
+}
+
+/**
+ * Encode a WebSocket frame (server frames are never masked)
+ * @param payload: frame payload
+ * @param opcode: 0x1 text, 0x8 close, 0xA pong
+ */
+std::string ws_encode_frame(const std::string &payload, uint8_t opcode = 0x1) {
+  std::string frame;
+  frame.reserve(payload.size() + 10);
+  frame.push_back(static_cast<char>(0x80 | opcode)); // FIN + opcode
+  if (payload.size() < 126) {
+    frame.push_back(static_cast<char>(payload.size()));
+  } else if (payload.size() <= 0xffff) {
+    frame.push_back(126);
+    frame.push_back(static_cast<char>((payload.size() >> 8) & 0xff));
+    frame.push_back(static_cast<char>(payload.size() & 0xff));
+  } else {
+    frame.push_back(127);
+    for (int i = 7; i >= 0; --i)
+      frame.push_back(static_cast<char>((uint64_t(payload.size()) >> (i * 8)) & 0xff));
+  }
+  frame += payload;
+  return frame;
+}
+
+/**
+ * Unmask a client frame payload in place
+ * @param data: payload bytes
+ * @param len: payload length
+ * @param key: 4-byte masking key
+ * XORs eight bytes at a time, then finishes the tail bytewise.
+ */
+void ws_unmask(char *data, size_t len, const unsigned char key[4]) {
+  uint64_t key64;
+  unsigned char pattern[8];
+  for (int i = 0; i < 8; ++i)
+    pattern[i] = key[i % 4];
+  memcpy(&key64, pattern, sizeof(key64));
+
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    word ^= key64;
+    memcpy(data + i, &word, sizeof(word));
+  }
+  for (; i < len; ++i)
+    data[i] ^= key[i % 4];
+}
+
+/**
+ * Bytes written to a socket that the peer has not acknowledged yet
+ * @param fd: socket file descriptor
+ */
+int pending_output(int fd) {
+  int queued = 0;
+  if (ioctl(fd, SIOCOUTQ, &queued) == -1)
+    return 0;
+  return queued;
+}
+
+/**
+ * Get IP address from sockaddr
+ * @param sa: sockaddr
+ */
+void *get_in_addr(struct sockaddr *sa) {
+
+  if (sa->sa_family == AF_INET) {
+    return &(((struct sockaddr_in *)sa)->sin_addr);
+  }
+  return &(((struct sockaddr_in6 *)sa)->sin6_addr);
+}
+
+/**
+ * Open a non-blocking listening socket
+ * @param host: address to bind, nullptr for all interfaces
+ * @param port: port to listen on
+ * @return: listening file descriptor
+ */
+int open_listener(const char *host, const char *port) {
+  struct addrinfo hints = {}, *ai, *p;
+  hints.ai_family = AF_UNSPEC;     // Use IPv4 or IPv6, whichever
+  hints.ai_socktype = SOCK_STREAM; // TCP
+  hints.ai_flags = AI_PASSIVE;     // use localhost
+
+  int rv = getaddrinfo(host, port, &hints, &ai);
+  if (rv != 0) {
+    throw std::runtime_error("getaddrinfo: " + std::string(gai_strerror(rv)));
+  }
+
+  int fd = -1;
+  for (p = ai; p != nullptr; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+
+    // Allow reusing the same port.
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    if (bind(fd, p->ai_addr, p->ai_addrlen) == -1) {
+      close(fd);
+      continue;
+    }
+
+    break;
+  }
+
+  freeaddrinfo(ai);
+
+  if (p == nullptr) {
+    throw std::runtime_error("Failed to bind listener socket on port " +
+                             std::string(port));
+  }
+
+  if (listen(fd, SOMAXCONN) == -1) {
+    throw std::runtime_error("listen failed");
+  }
+
+  // Set the listener to non-blocking.
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  return fd;
+}
+
+/**
+ * ChatServer constructor
+ * Initialize the server
+ */
+void ChatServer::setup_listener() {
+  listener_fd = open_listener(nullptr, PORT);
+
+  std::cout << "Server is ready and waiting for connections on " << PORT
+            << std::endl;
+
+  // Create epoll instance.
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd == -1) {
+    throw std::runtime_error("epoll_create1 failed");
+  }
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN; // Read events
+  ev.data.fd = listener_fd;
+
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener_fd, &ev) == -1) {
+    throw std::runtime_error("epoll_ctl: listener_fd failed");
+  }
+}
+
+/**
+ * Setup admin listener
+ * The admin socket is a Unix socket created with mode 0600, and each
+ * connection's peer credentials are checked as well, so only the
+ * server's own user (or root) can run admin commands.
+ */
+void ChatServer::setup_admin_listener() {
+  admin_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (admin_fd == -1)
+    throw std::runtime_error("admin socket failed");
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, ADMIN_SOCKET, sizeof(addr.sun_path) - 1);
+  unlink(ADMIN_SOCKET);
+  mode_t old_mask = umask(0177);
+  int rv = bind(admin_fd, reinterpret_cast<struct sockaddr *>(&addr),
+                sizeof(addr));
+  umask(old_mask);
+  if (rv == -1 || chmod(ADMIN_SOCKET, 0600) == -1 ||
+      listen(admin_fd, SOMAXCONN) == -1) {
+    throw std::runtime_error("Failed to open admin socket " +
+                             std::string(ADMIN_SOCKET));
+  }
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = admin_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, admin_fd, &ev) == -1) {
+    throw std::runtime_error("epoll_ctl: admin_fd failed");
+  }
+  std::cout << "Admin interface on " << ADMIN_SOCKET << std::endl;
+}
+
+/**
+ * Setup WebSocket listener
+ * Browser clients connect here; they share the event loop and every chat
+ * structure with TCP clients.
+ */
+void ChatServer::setup_ws_listener() {
+  ws_listener_fd = open_listener(nullptr, WS_PORT);
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = ws_listener_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ws_listener_fd, &ev) == -1) {
+    throw std::runtime_error("epoll_ctl: ws_listener_fd failed");
+  }
+  std::cout << "WebSocket endpoint on " << WS_PORT << std::endl;
+}
+
+/**
+ * Handle new admin connection
+ */
+void ChatServer::handle_new_admin() {
+  int new_fd = accept(admin_fd, nullptr, nullptr);
+  if (new_fd == -1) {
+    perror("accept");
+    return;
+  }
+  struct ucred peer;
+  socklen_t peer_len = sizeof(peer);
+  if (getsockopt(new_fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) == -1 ||
+      (peer.uid != geteuid() && peer.uid != 0)) {
+    close(new_fd);
+    return;
+  }
+  int flags = fcntl(new_fd, F_GETFL, 0);
+  fcntl(new_fd, F_SETFL, flags | O_NONBLOCK);
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+  ev.data.fd = new_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
+    perror("epoll_ctl: add admin fd");
+    close(new_fd);
+    return;
+  }
+  admins.insert(new_fd);
+  // Output is queued like a client's; no heartbeat, sessions or users.
+  Connection conn = {};
+  conn.fd = new_fd;
+  conn.id = next_connection_id++;
+  conn.lastActivity = now_ms();
+  connections[new_fd] = conn;
+}
+
+/**
+ * Handle admin message
+ * @param admin_conn: admin connection file descriptor
+ * Each complete line is one command; a partial line waits in the
+ * connection's input buffer. Replies go through the connection's output
+ * queue, so long replies are written in full as the socket drains.
+ */
+void ChatServer::handle_admin_message(int admin_conn) {
+  char buf[BUF_SIZE];
+  ssize_t nbytes;
+  bool oversized = false;
+  // Edge-triggered: read until the socket is drained.
+  while ((nbytes = recv(admin_conn, buf, sizeof(buf), 0)) > 0) {
+    Connection &conn = connections[admin_conn];
+    conn.inbuf.append(buf, nbytes);
+    size_t start = 0, newline;
+    while ((newline = conn.inbuf.find('\n', start)) != std::string::npos) {
+      std::string line = conn.inbuf.substr(start, newline - start);
+      start = newline + 1;
+      strip_input(line);
+      if (!line.empty())
+        queue_output(admin_conn, run_admin_command(line), Lane::CONTROL);
+    }
+    conn.inbuf.erase(0, start);
+    if (conn.inbuf.size() > MAX_MESSAGE_SIZE) {
+      oversized = true; // no command is this long
+      break;
+    }
+  }
+  // After the peer's EOF, stay open until the replies are written; the
+  // EPOLL_CTL_MOD when the queue empties reports the EOF again.
+  auto it = connections.find(admin_conn);
+  bool drained = it == connections.end() || it->second.queuedBytes == 0;
+  if (oversized || (nbytes == 0 && drained) ||
+      (nbytes < 0 && errno != EWOULDBLOCK && errno != EAGAIN)) {
+    admins.erase(admin_conn);
+    connections.erase(admin_conn);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, admin_conn, nullptr);
+    close(admin_conn);
+  }
+}
+
+/**
+ * Run admin command
+ * @param line: command line
+ * @return: reply text
+ */
+std::string ChatServer::run_admin_command(const std::string &line) {
+  std::stringstream ss(line);
+  std::string command;
+  ss >> command;
+
+  if (command == "top") {
+    std::string what, metric;
+    ss >> what >> metric;
+    const HeavyHitters *stats = nullptr;
+    if (what == "senders")
+      stats = &topSenders;
+    else if (what == "groups")
+      stats = &topGroups;
+    else if (what == "recipients")
+      stats = &topRecipients;
+    if (stats == nullptr || (!metric.empty() && metric != "messages" &&
+                             metric != "bytes")) {
+      return "usage: top senders|groups|recipients [messages|bytes]\n";
+    }
+
+    bool by_bytes = metric == "bytes";
+    std::string reply = "top " + what + " by " +
+                        (by_bytes ? "bytes" : "messages") + " (estimates)\n";
+    int rank = 1;
+    for (const auto &entry : stats->top(by_bytes)) {
+      reply += std::to_string(rank++) + ". " + entry.first + " " +
+               std::to_string(entry.second) + "\n";
+    }
+    return reply;
+  }
+  if (command == "compact") {
+    run_compaction(true);
+    return "compaction started: " +
+           std::to_string(journal.sealed_segments().size()) +
+           " uncompressed sealed segments, " +
+           std::to_string(journal.archived_segments().size()) + " archives\n";
+  }
+  if (command == "retention") {
+    std::string group, age, bytes, extra;
+    ss >> group >> age >> bytes;
+    auto number = [](const std::string &value) {
+      return !value.empty() && value.size() < 16 &&
+             value.find_first_not_of("0123456789") == std::string::npos;
+    };
+    if (!number(age) || !number(bytes) || (ss >> extra))
+      return "usage: retention <group> <max age seconds> <max bytes>\n";
+    if (groupTofd.count(group) == 0)
+      return "group not found\n";
+    set_retention(group, std::stoull(age), std::stoull(bytes), "admin");
+    return describe_retention(group);
+  }
+  if (command == "import") {
+    std::string name, extra;
+    ss >> name;
+    // Only plain file names inside IMPORT_DIR.
+    if (name.empty() || (ss >> extra) || name[0] == '.' ||
+        name.find('/') != std::string::npos)
+      return "usage: import <file in " IMPORT_DIR "/>\n";
+    return import_provisioning(std::string(IMPORT_DIR) + "/" + name);
+  }
+  return "commands:\n"
+         "  top senders|groups|recipients [messages|bytes]\n"
+         "  compact\n"
+         "  retention <group> <max age seconds> <max bytes>\n"
+         "  import <file in " IMPORT_DIR "/>\n";
+}
+
+/**
+ * Bulk import of users, groups and memberships
+ * @param path: provisioning file under IMPORT_DIR
+ * Lines are "user <name> <password>", "group <name> [<member> ...]" and
+ * "member <group> <user> ...", in any order; lines starting with '#' are
+ * comments. The whole file is checked before anything changes, so a bad
+ * line imports nothing. Errors name the line, never its contents. New
+ * users are added to users.txt with one rename; each group is then
+ * journaled as a single GROUP_IMPORT record and applied in the same
+ * event-loop turn, so clients never see a partial import.
+ */
+std::string ChatServer::import_provisioning(const std::string &path) {
+  int64_t started = unix_ms();
+  std::ifstream in(path);
+  if (!in.is_open())
+    return "import failed: cannot open the file\n";
+
+  struct StagedGroup {
+    std::string name;
+    size_t line;                            // first line naming the group
+    bool declared = false;                  // has a "group" line
+    std::vector<std::pair<std::string, size_t>> members; // username, line
+  };
+  reload_credentials();
+  std::vector<std::pair<std::string, std::string>> newUsers;
+  std::unordered_map<std::string, std::string> staged; //? new username -> password
+  std::vector<StagedGroup> groups;
+  std::unordered_map<std::string, size_t> groupIndex;  //? groupname -> position in groups
+  std::string line;
+  size_t line_no = 0;
+  while (std::getline(in, line)) {
+    ++line_no;
+    std::stringstream ss(line);
+    std::string kind, name;
+    if (!(ss >> kind) || kind[0] == '#')
+      continue;
+    std::string failed = "import failed: line " + std::to_string(line_no) + ": ";
+    if (!(ss >> name))
+      return failed + "missing name\n";
+
+    if (kind == "user") {
+      std::string password, extra;
+      if (!(ss >> password) || (ss >> extra))
+        return failed + "expected user <name> <password>\n";
+      if (name.find(':') != std::string::npos)
+        return failed + "username may not contain ':'\n";
+      if (has_control_bytes(name) || has_control_bytes(password))
+        return failed + "control bytes are not allowed\n";
+      auto known = credentials.find(name);
+      if (known != credentials.end() ? known->second != password
+                                     : staged.count(name) > 0)
+        return failed + "user already exists\n";
+      if (known == credentials.end()) {
+        staged[name] = password;
+        newUsers.emplace_back(name, password);
+      }
+    } else if (kind == "group" || kind == "member") {
+      if (!valid_group_name(name))
+        return failed + "group name may not contain '*', '!' or control bytes\n";
+      auto it = groupIndex.find(name);
+      if (it == groupIndex.end()) {
+        it = groupIndex.emplace(name, groups.size()).first;
+        groups.emplace_back();
+        groups.back().name = name;
+        groups.back().line = line_no;
+      }
+      StagedGroup &group = groups[it->second];
+      group.declared |= kind == "group";
+      std::string member;
+      while (ss >> member)
+        group.members.emplace_back(member, line_no);
+    } else {
+      return failed + "unknown entry\n";
+    }
+  }
+  for (const StagedGroup &group : groups) {
+    if (!group.declared && groupTofd.count(group.name) == 0)
+      return "import failed: line " + std::to_string(group.line) +
+             ": unknown group\n";
+    for (const auto &member : group.members) {
+      if (credentials.count(member.first) == 0 &&
+          staged.count(member.first) == 0)
+        return "import failed: line " + std::to_string(member.second) +
+               ": unknown user\n";
+    }
+  }
+
+  // Publish the users first: a crash before the groups leaves users only.
+  if (!newUsers.empty()) {
+    std::string contents;
+    {
+      std::ifstream current(FILENAME);
+      contents.assign(std::istreambuf_iterator<char>(current),
+                      std::istreambuf_iterator<char>());
+    }
+    if (!contents.empty() && contents.back() != '\n')
+      contents.push_back('\n');
+    for (const auto &user : newUsers)
+      contents += user.first + ":" + user.second + "\n";
+
+    std::string tmp = std::string(FILENAME) + ".import";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    size_t written = 0;
+    while (fd != -1 && written < contents.size()) {
+      ssize_t n = write(fd, contents.data() + written,
+                        contents.size() - written);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n == -1)
+        break;
+      written += n;
+    }
+    bool ok = fd != -1 && written == contents.size() && fsync(fd) == 0;
+    if (fd != -1)
+      close(fd);
+    if (!ok || rename(tmp.c_str(), FILENAME) == -1) {
+      unlink(tmp.c_str());
+      return "import failed: cannot replace " + std::string(FILENAME) + "\n";
+    }
+    // Make the rename itself durable.
+    int dir_fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (dir_fd != -1) {
+      fsync(dir_fd);
+      close(dir_fd);
+    }
+    for (const auto &user : newUsers)
+      credentials[user.first] = user.second;
+    struct stat st;
+    if (stat(FILENAME, &st) == 0)
+      credentialsMtime =
+          int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  }
+
+  size_t created = 0, memberships = 0;
+  for (StagedGroup &group : groups) {
+    std::vector<std::string> members;
+    members.reserve(group.members.size());
+    for (auto &member : group.members)
+      members.push_back(std::move(member.first));
+    std::sort(members.begin(), members.end());
+    members.erase(std::unique(members.begin(), members.end()), members.end());
+    auto existing = groupMembers.find(group.name);
+    bool is_new = groupTofd.count(group.name) == 0;
+    std::string text;
+    size_t added = 0;
+    for (const std::string &member : members) {
+      if (existing != groupMembers.end() && existing->second.count(member) > 0)
+        continue;
+      if (!text.empty())
+        text.push_back(' ');
+      text += member;
+      ++added;
+    }
+    if (!is_new && added == 0)
+      continue;
+    uint64_t seq = journal.append(RecordKind::GROUP_IMPORT, group.name, text);
+    apply_record(
+        JournalRecord{seq, 0, RecordKind::GROUP_IMPORT, group.name, text, 0, 0});
+    // As with /join_group, nothing earlier is owed to pull-mode readers.
+    auto delivery = groupDelivery.find(group.name);
+    if (delivery != groupDelivery.end() && delivery->second.pullSince > 0) {
+      std::stringstream names(text);
+      std::string member;
+      while (names >> member)
+        readCursors[group.name][member] = seq;
+    }
+    created += is_new;
+    memberships += added;
+  }
+  journal.sync();
+
+  return "imported " + std::to_string(newUsers.size()) + " users, " +
+         std::to_string(groups.size()) + " groups (" +
+         std::to_string(created) + " new), " + std::to_string(memberships) +
+         " memberships in " + std::to_string(unix_ms() - started) + " ms\n";
+}
+
+/**
+ * Setup timer
+ * Create a periodic timerfd that ticks the timer wheel from the epoll loop
+ */
+void ChatServer::setup_timer() {
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (timer_fd == -1) {
+    throw std::runtime_error("timerfd_create failed");
+  }
+
+  struct itimerspec spec = {};
+  spec.it_interval.tv_sec = TICK_MS / 1000;
+  spec.it_interval.tv_nsec = (TICK_MS % 1000) * 1000000;
+  spec.it_value = spec.it_interval;
+  if (timerfd_settime(timer_fd, 0, &spec, nullptr) == -1) {
+    throw std::runtime_error("timerfd_settime failed");
+  }
+  timers.start(now_ms());
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = timer_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) == -1) {
+    throw std::runtime_error("epoll_ctl: timer_fd failed");
+  }
+}
+
+/**
+ * Handle timer tick
+ * Drain the timerfd and run the timers that are due
+ */
+void ChatServer::handle_timer_tick() {
+  uint64_t expirations;
+  while (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+  }
+  timers.advance(now_ms());
+  run_scheduled();
+}
+
+/**
+ * Schedule a heartbeat check for a client
+ * @param client_fd: client file descriptor
+ * @param delay_ms: delay before the check
+ */
+void ChatServer::schedule_heartbeat(int client_fd, int64_t delay_ms) {
+  uint64_t id = connections[client_fd].id;
+  timers.schedule(delay_ms,
+                  [this, client_fd, id]() { check_heartbeat(client_fd, id); });
+}
+
+/**
+ * Check heartbeat
+ * @param client_fd: client file descriptor
+ * @param id: connection id the check was scheduled for
+ * Ping the client if it has been idle, and evict it if a previous ping
+ * went unanswered for HEARTBEAT_TIMEOUT_MS.
+ */
+void ChatServer::check_heartbeat(int client_fd, uint64_t id) {
+  auto it = connections.find(client_fd);
+  if (it == connections.end() || it->second.id != id ||
+      !it->second.heartbeat) {
+    return; // connection closed, fd reused or heartbeat disabled
+  }
+  Connection &conn = it->second;
+  int64_t now = now_ms();
+
+  if (conn.pingToken != 0) {
+    if (now - conn.pingSentAt >= HEARTBEAT_TIMEOUT_MS) {
+      std::cout << "Socket " << client_fd << " missed heartbeat, evicting"
+                << std::endl;
+      disconnect_client(client_fd);
+      return;
+    }
+    schedule_heartbeat(client_fd, conn.pingSentAt + HEARTBEAT_TIMEOUT_MS - now);
+    return;
+  }
+
+  int64_t idle = now - conn.lastActivity;
+  if (idle < HEARTBEAT_INTERVAL_MS) {
+    schedule_heartbeat(client_fd, HEARTBEAT_INTERVAL_MS - idle);
+    return;
+  }
+
+  conn.pingToken = conn.id * 1000003 + static_cast<uint64_t>(now);
+  conn.pingSentAt = now;
+  std::string ping = "PING " + std::to_string(conn.pingToken) + "\n";
+  send_to(client_fd, ping);
+  schedule_heartbeat(client_fd, HEARTBEAT_TIMEOUT_MS);
+}
+
+/**
+ * Handle new connection
+ * @param listen_fd: listener that became readable (chat or WebSocket port)
+ * Accept new connection and add to epoll
+ */
+
+void ChatServer::handle_new_connection(int listen_fd) {
+  struct sockaddr_storage remoteaddr;
+  socklen_t addrlen = sizeof(remoteaddr);
+  char remoteIP[INET6_ADDRSTRLEN];
+
+  int new_fd = accept(listen_fd, (struct sockaddr *)&remoteaddr, &addrlen);
+  if (new_fd == -1) {
+    perror("accept");
+    return;
+  }
+
+  // Print remote client info.
+  std::cout << "New connection from "
+            << inet_ntop(remoteaddr.ss_family,
+                         get_in_addr((struct sockaddr *)&remoteaddr), remoteIP,
+                         INET6_ADDRSTRLEN)
+            << " on socket " << new_fd << std::endl;
+
+  // Set new_fd to non-blocking.
+  int flags = fcntl(new_fd, F_GETFL, 0);
+  fcntl(new_fd, F_SETFL, flags | O_NONBLOCK);
+  enable_keepalive(new_fd);
+  enable_rx_timestamps(new_fd);
+
+  Connection conn = {};
+  conn.fd = new_fd;
+  conn.id = next_connection_id++;
+  conn.lastActivity = now_ms();
+  connections[new_fd] = conn;
+
+  if (listen_fd == ws_listener_fd) {
+    // The login prompt follows the HTTP upgrade.
+    webSockets[new_fd] = WebSocketConn{};
+  } else {
+    start_session(new_fd);
+  }
+
+  // Add to epoll.
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+  ev.data.fd = new_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
+    perror("epoll_ctl: add new_fd");
+    close(new_fd);
+    sessions.erase(new_fd);
+    connections.erase(new_fd);
+    webSockets.erase(new_fd);
+  }
+}
+
+/**
+ * Start session
+ * @param client_fd: client file descriptor
+ * Create the login state for a new client and prompt for the username
+ */
+void ChatServer::start_session(int client_fd) {
+  ClientSession session;
+  session.fd = client_fd;
+  session.state = ClientState::WAITING_USERNAME;
+  sessions[client_fd] = session;
+
+  std::string prompt = "Enter the username:\n";
+  send_to(client_fd, prompt);
+}
+
+/**
+ * Handle WebSocket data
+ * @param client_fd: WebSocket client
+ * @param data: bytes received
+ * Complete the HTTP upgrade first, then decode client frames. Each text or
+ * binary message is one chat line.
+ */
+void ChatServer::handle_websocket_data(int client_fd, const std::string &data) {
+  WebSocketConn &ws = webSockets[client_fd];
+  ws.inbuf += data;
+
+  if (!ws.upgraded) {
+    size_t end = ws.inbuf.find("\r\n\r\n");
+    if (end == std::string::npos) {
+      if (ws.inbuf.size() > 8192)
+        disconnect_client(client_fd);
+      return;
+    }
+    std::string request = ws.inbuf.substr(0, end);
+    ws.inbuf.erase(0, end + 4);
+
+    std::string key;
+    std::stringstream lines(request);
+    std::string line;
+    while (std::getline(lines, line)) {
+      size_t colon = line.find(':');
+      if (colon == std::string::npos)
+        continue;
+      std::string name = line.substr(0, colon);
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      if (name == "sec-websocket-key") {
+        key = line.substr(colon + 1);
+        strip_input(key);
+      }
+    }
+    if (key.empty()) {
+      std::string reply = "HTTP/1.1 400 Bad Request\r\n\r\n";
+      queue_output(client_fd, reply, Lane::CONTROL);
+      disconnect_client(client_fd);
+      return;
+    }
+
+    std::string accept_key =
+        base64_encode(sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+    std::string reply = "HTTP/1.1 101 Switching Protocols\r\n"
+                        "Upgrade: websocket\r\n"
+                        "Connection: Upgrade\r\n"
+                        "Sec-WebSocket-Accept: " +
+                        accept_key + "\r\n\r\n";
+    queue_output(client_fd, reply, Lane::CONTROL);
+    ws.upgraded = true;
+    start_session(client_fd);
+  }
+
+  while (ws.inbuf.size() >= 2) {
+    const unsigned char *b =
+        reinterpret_cast<const unsigned char *>(ws.inbuf.data());
+    bool fin = b[0] & 0x80;
+    uint8_t opcode = b[0] & 0x0f;
+    bool masked = b[1] & 0x80;
+    uint64_t len = b[1] & 0x7f;
+    size_t header = 2;
+    if (len == 126) {
+      if (ws.inbuf.size() < 4)
+        return;
+      len = (uint64_t(b[2]) << 8) | b[3];
+      header = 4;
+    } else if (len == 127) {
+      if (ws.inbuf.size() < 10)
+        return;
+      len = 0;
+      for (int i = 0; i < 8; ++i)
+        len = (len << 8) | b[2 + i];
+      header = 10;
+    }
+    if (!masked || len > WS_MAX_MESSAGE ||
+        ws.fragments.size() + len > WS_MAX_MESSAGE) {
+      // Clients must mask; oversized messages are refused.
+      std::string close_frame = ws_encode_frame("", 0x8);
+      queue_output(client_fd, close_frame, Lane::CONTROL);
+      disconnect_client(client_fd);
+      return;
+    }
+    if (ws.inbuf.size() < header + 4 + len)
+      return;
+
+    unsigned char key[4];
+    memcpy(key, b + header, 4);
+    std::string payload = ws.inbuf.substr(header + 4, len);
+    ws.inbuf.erase(0, header + 4 + len);
+    ws_unmask(&payload[0], payload.size(), key);
+
+    if (opcode == 0x8) { // close
+      std::string close_frame = ws_encode_frame("", 0x8);
+      queue_output(client_fd, close_frame, Lane::CONTROL);
+      disconnect_client(client_fd);
+      return;
+    } else if (opcode == 0x9) { // ping
+      std::string pong = ws_encode_frame(payload, 0xA);
+      queue_output(client_fd, pong, Lane::CONTROL);
+    } else if (opcode == 0x0 || opcode == 0x1 || opcode == 0x2) {
+      ws.fragments += payload;
+      if (fin) {
+        std::string message;
+        message.swap(ws.fragments);
+        // Commands are framed by newline, as on TCP, so a frame holding
+        // several lines runs each one instead of passing them on as text.
+        std::stringstream lines(message);
+        std::string line;
+        while (std::getline(lines, line)) {
+          if (line.empty())
+            continue;
+          handle_line(client_fd, line);
+          // The line may have closed the connection.
+          if (webSockets.find(client_fd) == webSockets.end())
+            return;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Send one page of a listing
+ * @param client_fd: client file descriptor
+ * @param command: command that asked for it, repeated in the paging hint
+ * @param listing: online users or groups
+ * @param title: first line of the reply
+ * @param args: "[<prefix>] [after <name>]"
+ * The page body is a buffer shared with the listing's cache; on plain TCP
+ * connections it is queued as is, without copying.
+ */
+void ChatServer::send_listing(int client_fd, const std::string &command,
+                              SortedListing &listing, const std::string &title,
+                              const std::string &args) {
+  std::stringstream ss(args);
+  std::vector<std::string> words;
+  std::string word;
+  while (ss >> word)
+    words.push_back(word);
+  std::string prefix, after;
+  size_t next = 0;
+  if (!words.empty() && words[0] != "after")
+    prefix = words[next++];
+  if (next < words.size()) {
+    if (words[next] != "after" || next + 2 != words.size()) {
+      std::string server_message =
+          "Usage: " + command + " [<prefix>] [after <name>]\n";
+      send_server_error(client_fd, server_message);
+      return;
+    }
+    after = words[next + 1];
+  }
+
+  std::string last;
+  bool more = false;
+  std::shared_ptr<const std::string> body =
+      listing.page(prefix, after, last, more);
+  std::string header =
+      GREEN + title + " (" + std::to_string(listing.size()) + "):\n";
+  std::string footer;
+  if (body->empty())
+    footer = "None\n";
+  else if (more)
+    footer = "More: " + command + (prefix.empty() ? "" : " " + prefix) +
+             " after " + last + "\n";
+  footer += RESET;
+
+  if (client_fd < 0 || webSockets.count(client_fd) > 0) {
+    send_to(client_fd, header + *body + footer);
+    return;
+  }
+  queue_output(client_fd, header, Lane::CONTROL);
+  if (!body->empty())
+    queue_output(client_fd, body, Lane::CONTROL);
+  queue_output(client_fd, footer, Lane::CONTROL);
+}
+
 /**
  * Send message to client
  * @param client_fd: client file descriptor
- * @param message: message to send
+ * @param message: message to send
+ */
+void ChatServer::send_server(int client_fd, std::string &message) {
+  message = GREEN + message + RESET;
+  send_to(client_fd, message);
+}
+
+void ChatServer::send_server_error(int client_fd, std::string &message) {
+  ++errorsSent;
+  message = RED + "Error: " + message + RESET;
+  send_to(client_fd, message);
+}
+
+/**
+ * Queue output
+ * @param fd: socket file descriptor
+ * @param buf: bytes to write, possibly shared with other recipients
+ * @param lane: CONTROL for replies, prompts, pings and private messages;
+ *              BULK for group and broadcast traffic
+ * Control data overtakes queued bulk data, but never splits a message that
+ * is already partially written.
+ */
+void ChatServer::queue_output(int fd, std::shared_ptr<const std::string> buf,
+                              Lane lane) {
+  queue_output(fd, OutItem(std::move(buf)), lane);
+}
+
+/**
+ * Queue output
+ * @param fd: socket file descriptor
+ * @param item: buffer or journal file range
+ * @param lane: output lane
+ */
+void ChatServer::queue_output(int fd, OutItem item, Lane lane) {
+  auto it = connections.find(fd);
+  if (it == connections.end() || item.size() == 0)
+    return;
+  Connection &conn = it->second;
+
+  if (lane == Lane::BULK &&
+      conn.queuedBytes + conn.deferredBytes > OUTQUEUE_LIMIT) {
+    drop_bulk(conn); // slow reader: drop bulk, keep control flowing
+    return;
+  }
+  if (conn.streamLock != 0 && lane == Lane::BULK) {
+    // Nothing may interleave with a message being streamed to this client.
+    conn.deferredBytes += item.size();
+    conn.deferred.emplace_back(std::move(item), lane);
+    return;
+  }
+  if (conn.streamLock != 0) {
+    // Control output is not held back: the client leaves the stream and
+    // gets the whole message when it ends. Queue behind the cut-off text.
+    leave_stream(fd);
+    lane = Lane::BULK;
+  }
+  enqueue_output(conn, std::move(item), lane);
+}
+
+/**
+ * Drop bulk output for a connection over OUTQUEUE_LIMIT
+ * @param conn: slow connection
+ * A /sync client would move its last seq past the dropped records and
+ * never ask for them again, so its socket is shut down instead: epoll
+ * reports the hangup, and the client reconnects and re-syncs from the last
+ * record it actually received. Other clients are told once per backlog
+ * that messages are being dropped.
+ */
+void ChatServer::drop_bulk(Connection &conn) {
+  if (conn.droppedBulk++ > 0)
+    return;
+  if (syncClients.count(conn.fd) > 0) {
+    std::cerr << "Socket " << conn.fd << " too slow for /sync, closing"
+              << std::endl;
+    conn.lanes[0].clear();
+    conn.lanes[1].clear();
+    conn.queuedBytes = 0;
+    conn.headOffset = 0;
+    conn.partialLane = -1;
+    shutdown(conn.fd, SHUT_RDWR);
+    return;
+  }
+  // Gateway output is framed per session; admins get no bulk output.
+  if (gateways.count(conn.fd) > 0 || admins.count(conn.fd) > 0)
+    return;
+  std::string notice = RED + "Connection too slow: group and broadcast "
+                             "messages are being dropped\n" + RESET;
+  send_to(conn.fd, notice);
+}
+
+/**
+ * Enqueue output without the backlog and stream checks
+ * @param conn: connection
+ * @param item: bytes to write
+ * @param lane: output lane
+ */
+void ChatServer::enqueue_output(Connection &conn, OutItem item, Lane lane) {
+  conn.queuedBytes += item.size();
+  conn.lanes[static_cast<int>(lane)].push_back(std::move(item));
+
+  // While EPOLLOUT is armed the socket is known to be full.
+  if (!conn.wantWrite)
+    flush_output(conn.fd);
+}
+
+void ChatServer::queue_output(int fd, const std::string &data, Lane lane) {
+  queue_output(fd, std::make_shared<const std::string>(data), lane);
+}
+
+/**
+ * Flush output
+ * @param fd: socket file descriptor
+ * Write queued data in strict priority order until the socket is full, and
+ * arm EPOLLOUT only while something is left.
+ */
+void ChatServer::flush_output(int fd) {
+  auto it = connections.find(fd);
+  if (it == connections.end())
+    return;
+  Connection &conn = it->second;
+
+  while (true) {
+    int lane = conn.partialLane;
+    if (lane < 0)
+      lane = !conn.lanes[0].empty() ? 0 : (!conn.lanes[1].empty() ? 1 : -1);
+    if (lane < 0)
+      break;
+
+    const OutItem &item = conn.lanes[lane].front();
+    ssize_t n;
+    if (item.buf) {
+      n = send(fd, item.buf->data() + conn.headOffset,
+               item.buf->size() - conn.headOffset, MSG_NOSIGNAL);
+    } else {
+      // Journal range: the kernel copies it from the page cache.
+      off_t offset = item.offset + conn.headOffset;
+      n = sendfile(fd, item.file->fd, &offset, item.length - conn.headOffset);
+      if (n == 0) {
+        errno = EIO; // the segment is shorter than indexed
+        n = -1;
+      }
+    }
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        // Broken socket; epoll reports the error and the client is evicted.
+        conn.lanes[0].clear();
+        conn.lanes[1].clear();
+        conn.queuedBytes = 0;
+        conn.headOffset = 0;
+        conn.partialLane = -1;
+      }
+      break;
+    }
+    conn.headOffset += n;
+    conn.queuedBytes -= n;
+    if (conn.headOffset == item.size()) {
+      conn.lanes[lane].pop_front();
+      conn.headOffset = 0;
+      conn.partialLane = -1;
+    } else {
+      conn.partialLane = lane;
+    }
+  }
+
+  bool want = conn.queuedBytes > 0;
+  if (!want)
+    conn.droppedBulk = 0; // caught up: the next overflow is reported again
+  if (want != conn.wantWrite) {
+    conn.wantWrite = want;
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    if (want)
+      ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+  }
+}
+
+/**
+ * Output backlog
+ * @param client_fd: client file descriptor or logical session id
+ * @return: bytes queued in the server plus bytes unacknowledged in the kernel
+ */
+size_t ChatServer::output_backlog(int client_fd) {
+  if (client_fd < 0) {
+    auto it = logicalSessions.find(client_fd);
+    if (it == logicalSessions.end())
+      return 0;
+    client_fd = it->second.gatewayFd;
+  }
+  auto it = connections.find(client_fd);
+  size_t queued = it == connections.end()
+                      ? 0
+                      : it->second.queuedBytes + it->second.deferredBytes;
+  return queued + pending_output(client_fd);
+}
+
+/**
+ * Take credit
+ * @param client_fd: recipient of a group or broadcast message
+ * @param buf: the message, held if the recipient has no credit left
+ * @return: true if the message may be sent now
+ * Clients without flow control always have credit. For the others,
+ * messages beyond their credit are held up to CREDIT_HOLD_LIMIT and
+ * counted after that.
+ */
+bool ChatServer::take_credit(int client_fd,
+                             const std::shared_ptr<const std::string> &buf) {
+  auto it = flowControl.find(client_fd);
+  if (it == flowControl.end())
+    return true;
+  FlowControl &fc = it->second;
+  if (fc.credits > 0 && fc.held.empty()) {
+    --fc.credits;
+    return true;
+  }
+  if (fc.held.size() < CREDIT_HOLD_LIMIT)
+    fc.held.push_back(buf);
+  else
+    ++fc.skipped;
+  return false;
+}
+
+/**
+ * Grant credit
+ * @param client_fd: client file descriptor or logical session id
+ * @param credits: additional messages the client accepts
+ * Held messages are released first; once they are all out, the client is
+ * told how many were skipped while it was out of credit.
+ */
+void ChatServer::grant_credit(int client_fd, uint64_t credits) {
+  FlowControl &fc = flowControl[client_fd];
+  fc.credits += credits;
+  while (fc.credits > 0 && !fc.held.empty()) {
+    send_to(client_fd, *fc.held.front(), Lane::BULK);
+    fc.held.pop_front();
+    --fc.credits;
+  }
+  if (fc.held.empty() && fc.skipped > 0) {
+    std::string summary = std::to_string(fc.skipped) +
+                          " messages skipped while out of credit\n";
+    fc.skipped = 0;
+    send_server(client_fd, summary);
+  }
+}
+
+/**
+ * Send to client
+ * @param client_fd: client file descriptor, or a logical session id (< 0)
+ * @param data: bytes to deliver
+ * @param lane: output lane, CONTROL unless stated otherwise
+ * Logical sessions are reached through their gateway connection, framed as
+ * "@<sid> <length>\n<data>".
+ */
+void ChatServer::send_to(int client_fd, const std::string &data, Lane lane) {
+  if (client_fd >= 0) {
+    if (webSockets.find(client_fd) != webSockets.end()) {
+      queue_output(client_fd, ws_encode_frame(data), lane);
+      return;
+    }
+    queue_output(client_fd, data, lane);
+    return;
+  }
+  auto it = logicalSessions.find(client_fd);
+  if (it == logicalSessions.end())
+    return;
+  std::string frame = "@" + it->second.sid + " " +
+                      std::to_string(data.size()) + "\n" + data;
+  queue_output(it->second.gatewayFd, frame, lane);
+}
+
+/**
+ * Deliver one message to many clients
+ * @param recipients: client file descriptors or logical session ids
+ * @param data: bytes to deliver, identical for every recipient
+ * Every recipient queues the same buffer on its bulk lane. Recipients
+ * behind the same gateway share one frame that lists all of their session
+ * ids: "@<sid>,<sid>,... <length>\n<data>". WebSocket recipients share one
+ * encoded frame.
+ */
+void ChatServer::deliver_many(const std::vector<int> &recipients,
+                              const std::string &data) {
+  auto plain = std::make_shared<const std::string>(data);
+  std::shared_ptr<const std::string> ws_frame;
+  deliver_many(recipients, plain, ws_frame);
+}
+
+/**
+ * Deliver one shared message to many clients
+ * @param recipients: client file descriptors or logical session ids
+ * @param plain: the message
+ * @param ws_frame: its WebSocket frame; built here on first use, so callers
+ *                  delivering in slices encode it only once
+ * @param tagged: sequence-tagged record for clients that sent /sync, or null
+ */
+void ChatServer::deliver_many(const std::vector<int> &recipients,
+                              const std::shared_ptr<const std::string> &plain,
+                              std::shared_ptr<const std::string> &ws_frame,
+                              const std::shared_ptr<const std::string> &tagged) {
+  //? gateway fd -> sid list, for plain and for tagged sessions
+  std::unordered_map<int, std::string> gatewaySids[2];
+  for (int client_fd : recipients) {
+    bool use_tagged = tagged && syncClients.count(client_fd) > 0;
+    const std::shared_ptr<const std::string> &buf = use_tagged ? tagged : plain;
+    if (!take_credit(client_fd, buf))
+      continue;
+    if (client_fd >= 0) {
+      if (webSockets.find(client_fd) != webSockets.end()) {
+        if (use_tagged) {
+          queue_output(client_fd, ws_encode_frame(*buf), Lane::BULK);
+          continue;
+        }
+        if (!ws_frame)
+          ws_frame = std::make_shared<const std::string>(ws_encode_frame(*plain));
+        queue_output(client_fd, ws_frame, Lane::BULK);
+        continue;
+      }
+      queue_output(client_fd, buf, Lane::BULK);
+      continue;
+    }
+    auto it = logicalSessions.find(client_fd);
+    if (it == logicalSessions.end())
+      continue;
+    std::string &sids = gatewaySids[use_tagged][it->second.gatewayFd];
+    if (!sids.empty())
+      sids.push_back(',');
+    sids += it->second.sid;
+  }
+  for (int variant = 0; variant < 2; ++variant) {
+    const std::string &data = variant ? *tagged : *plain;
+    for (const auto &entry : gatewaySids[variant]) {
+      std::string frame = "@" + entry.second + " " +
+                          std::to_string(data.size()) + "\n" + data;
+      queue_output(entry.first, frame, Lane::BULK);
+    }
+  }
+}
+
+/**
+ * Schedule fanout
+ * @param group: group name, or "*" for broadcasts
+ * @param recipients: recipients of the message
+ * @param data: message, identical for every recipient
+ * @param tagged: sequence-tagged form of a journaled message, or empty
+ * The message is delivered by run_fanout(), interleaved with other groups.
+ */
+void ChatServer::schedule_fanout(const std::string &group,
+                                 const std::vector<int> &recipients,
+                                 const std::string &data,
+                                 const std::string &tagged) {
+  if (recipients.empty())
+    return;
+  FanoutJob job;
+  job.data = std::make_shared<const std::string>(data);
+  if (!tagged.empty())
+    job.tagged = std::make_shared<const std::string>(tagged);
+  job.recipients = recipients;
+  job.connectionIds.reserve(recipients.size());
+  for (int client_fd : recipients) {
+    auto it = connections.find(client_fd);
+    job.connectionIds.push_back(it == connections.end() ? 0 : it->second.id);
+  }
+
+  FanoutQueue &queue = fanoutQueues[group];
+  queue.jobs.push_back(std::move(job));
+  if (!queue.active) {
+    queue.active = true;
+    fanoutRing.push_back(group);
+  }
+}
+
+/**
+ * Run fanout
+ * @return: true if fanout work is left for the next iteration
+ * Deficit round robin over the groups with pending messages: each visit a
+ * group may serve FANOUT_QUANTUM recipients per unit of its QoS weight, so
+ * a huge group cannot hold back small ones. At most FANOUT_BUDGET
+ * recipients are served per call so sockets keep being polled.
+ */
+bool ChatServer::run_fanout() {
+  size_t budget = FANOUT_BUDGET;
+  while (budget > 0 && !fanoutRing.empty()) {
+    std::string group = fanoutRing.front();
+    fanoutRing.pop_front();
+    FanoutQueue &queue = fanoutQueues[group];
+
+    auto qos = groupQos.find(group);
+    QosClass cls = qos == groupQos.end() ? QosClass::NORMAL : qos->second;
+    size_t weight = cls == QosClass::REALTIME ? 8 : (cls == QosClass::NORMAL ? 4 : 1);
+    queue.deficit += FANOUT_QUANTUM * weight;
+
+    while (queue.deficit > 0 && budget > 0 && !queue.jobs.empty()) {
+      FanoutJob &job = queue.jobs.front();
+      size_t count = std::min({queue.deficit, budget,
+                               job.recipients.size() - job.next});
+      std::vector<int> slice;
+      slice.reserve(count);
+      for (size_t i = job.next; i < job.next + count; ++i) {
+        int client_fd = job.recipients[i];
+        // Skip recipients that left, or whose fd now belongs to someone else.
+        bool valid = client_fd < 0
+                         ? logicalSessions.count(client_fd) > 0
+                         : (connections.count(client_fd) > 0 &&
+                            connections[client_fd].id == job.connectionIds[i]);
+        if (valid)
+          slice.push_back(client_fd);
+      }
+      deliver_many(slice, job.data, job.wsFrame, job.tagged);
+      job.next += count;
+      queue.deficit -= count;
+      budget -= count;
+      if (job.next == job.recipients.size())
+        queue.jobs.pop_front();
+    }
+
+    if (queue.jobs.empty()) {
+      fanoutQueues.erase(group);
+    } else {
+      fanoutRing.push_back(group);
+    }
+  }
+  return !fanoutRing.empty();
+}
+
+/**
+ * Whether a client is reading
+ * @param client_fd: client file descriptor or logical session id
+ * @param now: current time (ms)
+ * A client is reading if it sent a command within ACTIVE_READER_MS.
+ */
+bool ChatServer::is_reading(int client_fd, int64_t now) {
+  auto it = activeReaders.find(client_fd);
+  return it != activeReaders.end() && now - it->second <= ACTIVE_READER_MS;
+}
+
+/**
+ * Note a command from a client
+ * @param client_fd: client file descriptor or logical session id
+ * A client that was idle first catches up on its pull-mode groups, so
+ * their messages arrive before the reply to the command.
+ */
+void ChatServer::note_reader(int client_fd) {
+  int64_t now = now_ms();
+  if (!is_reading(client_fd, now))
+    catch_up(client_fd);
+  activeReaders[client_fd] = now;
+}
+
+/**
+ * Catch up on pull-mode groups
+ * @param client_fd: client that became active
+ * Sends the messages of each group that were not pushed to this member,
+ * from its read cursor, out of the in-memory tail; older ones are left to
+ * /history. Members without a cursor start where pull mode began.
+ */
+void ChatServer::catch_up(int client_fd) {
+  auto groups = fdTogroups.find(client_fd);
+  if (groups == fdTogroups.end())
+    return;
+  const std::string &username = fdTousername[client_fd];
+  for (const std::string &group : groups->second) {
+    auto delivery = groupDelivery.find(group);
+    if (delivery == groupDelivery.end() || delivery->second.pullSince == 0)
+      continue;
+    if (delivery->second.pull)
+      groupReaders[group].insert(client_fd);
+    auto missed = missedUntil.find(group);
+    if (missed != missedUntil.end() && missed->second.count(username) > 0) {
+      // Left over from an earlier pull period that was never caught up.
+      std::string gap = LIGHT_CYAN + "[ Group " + group + " ]" + RESET +
+                        " : missed messages: /history " + group +
+                        " before " +
+                        std::to_string(missed->second[username] + 1) + "\n";
+      send_to(client_fd, gap, Lane::BULK);
+      missed->second.erase(username);
+      if (missed->second.empty())
+        missedUntil.erase(missed);
+    }
+    std::unordered_map<std::string, uint64_t> &cursors = readCursors[group];
+    auto cursor = cursors.find(username);
+    uint64_t from = cursor == cursors.end() ? delivery->second.pullSince
+                                            : cursor->second;
+    uint64_t upto =
+        delivery->second.pull ? UINT64_MAX : delivery->second.pullUntil;
+    std::string key = "g:" + group;
+    const std::deque<HotEntry> &hot = hotHistory[key];
+    if (from >= upto) {
+      cursors.erase(username);
+      continue;
+    }
+    if (hot.empty() || hot.back().seq <= from)
+      continue;
+
+    std::string batch;
+    if (hot.front().seq > from + 1) {
+      batch += LIGHT_CYAN + "[ Group " + group + " ]" + RESET +
+               " : older messages: /history " + group + " before " +
+               std::to_string(hot.front().seq) + "\n";
+    }
+    uint64_t last = from;
+    for (const HotEntry &entry : hot) {
+      if (entry.seq <= from)
+        continue;
+      if (entry.seq > upto)
+        break;
+      last = entry.seq;
+      if (is_muted(client_fd, entry.sender, false))
+        continue;
+      batch += syncClients.count(client_fd) > 0
+                   ? tag_record(entry.seq, key, *entry.text)
+                   : *entry.text;
+    }
+    if (!batch.empty())
+      send_to(client_fd, batch, Lane::BULK);
+    if (delivery->second.pull)
+      cursors[username] = last;
+    else
+      cursors.erase(username);
+  }
+}
+
+/**
+ * Pick push or pull delivery for a group
+ * @param group: group name
+ * @param seq: message just sent
+ * @param reading: members who were reading when it was sent
+ * @param members: online members other than the sender
+ * Switches to pull when a large group's average read rate falls below
+ * PULL_ENTER_RATE, and back to push above PULL_EXIT_RATE.
+ */
+void ChatServer::update_delivery_mode(const std::string &group, uint64_t seq,
+                                      size_t reading, size_t members) {
+  GroupDelivery &delivery = groupDelivery[group];
+  if (members > 0) {
+    double rate = static_cast<double>(reading) / members;
+    delivery.readRate += (rate - delivery.readRate) / READ_RATE_WINDOW;
+  }
+  if (!delivery.pull && members >= PULL_MIN_MEMBERS &&
+      delivery.readRate < PULL_ENTER_RATE) {
+    // Members still holding a cursor never caught up on the previous pull
+    // period; its messages are past the hot tier by now, so they get a
+    // pointer to /history when they come back instead.
+    auto cursors = readCursors.find(group);
+    if (cursors != readCursors.end()) {
+      for (const auto &cursor : cursors->second) {
+        if (cursor.second < delivery.pullUntil)
+          missedUntil[group][cursor.first] = delivery.pullUntil;
+      }
+      readCursors.erase(cursors);
+    }
+    delivery.pull = true;
+    delivery.pullSince = seq;
+    std::unordered_set<int> &readers = groupReaders[group];
+    int64_t now = now_ms();
+    for (int member_fd : groupTofd[group]) {
+      if (is_reading(member_fd, now))
+        readers.insert(member_fd);
+    }
+    std::cout << "Group " << group << " switched to pull delivery"
+              << std::endl;
+  } else if (delivery.pull && (delivery.readRate > PULL_EXIT_RATE ||
+                               members < PULL_MIN_MEMBERS / 2)) {
+    delivery.pull = false;
+    delivery.pullUntil = seq;
+    groupReaders.erase(group);
+    // Give every member a cursor, so one still left when the group pulls
+    // again marks a member who never caught up on this period.
+    std::unordered_map<std::string, uint64_t> &cursors = readCursors[group];
+    for (const std::string &member : groupMembers[group])
+      cursors.emplace(member, delivery.pullSince);
+    std::cout << "Group " << group << " switched to push delivery"
+              << std::endl;
+  }
+}
+
+/**
+ * Whether a member gets a group's messages as digests
+ * @param client_fd: member
+ * @param group: group name
+ */
+bool ChatServer::wants_digest(int client_fd, const std::string &group) {
+  auto it = digests.find(client_fd);
+  return it != digests.end() && it->second.count(group) > 0;
+}
+
+/**
+ * Buffer a group message for a digest
+ * @param client_fd: member with a digest subscription
+ * @param group: group name
+ * @param seq: journal sequence number
+ * @param text: rendered message, shared with the other recipients
+ * The first buffered message starts the interval; reaching maxMessages
+ * sends the digest at once.
+ */
+void ChatServer::add_to_digest(int client_fd, const std::string &group,
+                               uint64_t seq,
+                               const std::shared_ptr<const std::string> &text) {
+  DigestSubscription &digest = digests[client_fd][group];
+  // Keep each digest write well under OUTQUEUE_LIMIT.
+  if (!digest.pending.empty() &&
+      digest.pendingBytes + text->size() > DIGEST_MAX_BYTES)
+    flush_digest(client_fd, group);
+  digest.pending.push_back(HotEntry{seq, 0, 0, text});
+  digest.pendingBytes += text->size();
+  if (digest.pending.size() >= digest.maxMessages ||
+      digest.pendingBytes >= DIGEST_MAX_BYTES) {
+    flush_digest(client_fd, group);
+  } else if (digest.timer == 0) {
+    uint64_t timer = next_digest_timer++;
+    digest.timer = timer;
+    timers.schedule(digest.intervalMs, [this, client_fd, group, timer]() {
+      auto it = digests.find(client_fd);
+      if (it == digests.end())
+        return;
+      auto sub = it->second.find(group);
+      if (sub != it->second.end() && sub->second.timer == timer)
+        flush_digest(client_fd, group);
+    });
+  }
+}
+
+/**
+ * Send a digest
+ * @param client_fd: member with a digest subscription
+ * @param group: group name
+ * All buffered messages go out as one write: a header line, then the
+ * messages (tagged records for /sync clients).
+ */
+void ChatServer::flush_digest(int client_fd, const std::string &group) {
+  DigestSubscription &digest = digests[client_fd][group];
+  digest.timer = 0;
+  if (digest.pending.empty())
+    return;
+  std::string key = "g:" + group;
+  bool tagged = syncClients.count(client_fd) > 0;
+  std::string batch = LIGHT_CYAN + "[ Digest " + group + ": " +
+                      std::to_string(digest.pending.size()) + " messages ]" +
+                      RESET + "\n";
+  for (const HotEntry &entry : digest.pending)
+    batch += tagged ? tag_record(entry.seq, key, *entry.text) : *entry.text;
+  digest.pending.clear();
+  digest.pendingBytes = 0;
+  send_to(client_fd, batch, Lane::BULK);
+}
+
+/**
+ * Point an online user's connection at its mute list
+ * @param username: user whose list was created, changed or erased
+ * Delivery checks onlineMuters by fd, so the string-keyed maps are only
+ * consulted at login and when a list changes.
+ */
+void ChatServer::refresh_muter(const std::string &username) {
+  auto online = usernameTofd.find(username);
+  if (online == usernameTofd.end())
+    return;
+  auto list = muteLists.find(username);
+  if (list == muteLists.end())
+    onlineMuters.erase(online->second);
+  else
+    onlineMuters[online->second] = &list->second;
+}
+
+/**
+ * Whether a recipient filters out a sender
+ * @param receiver_fd: recipient
+ * @param sender: sender's user_hash()
+ * @param direct: a direct message, refused only by /block
+ */
+bool ChatServer::is_muted(int receiver_fd, uint64_t sender, bool direct) {
+  if (onlineMuters.empty() || sender == 0)
+    return false;
+  auto list = onlineMuters.find(receiver_fd);
+  if (list == onlineMuters.end())
+    return false;
+  return direct ? list->second->blocks(sender) : list->second->mutes(sender);
+}
+
+/**
+ * Remove recipients who muted the sender
+ * @param recipients: fanout list, filtered in place
+ * @param sender: sender's user_hash()
+ * Runs before anything is encoded. Only recipients with a mute list cost
+ * more than one hash lookup: a Bloom filter probe, and a set lookup on a
+ * filter hit.
+ */
+void ChatServer::drop_muted(std::vector<int> &recipients, uint64_t sender) {
+  if (onlineMuters.empty() || sender == 0)
+    return;
+  recipients.erase(std::remove_if(recipients.begin(), recipients.end(),
+                                  [this, sender](int receiver_fd) {
+                                    return is_muted(receiver_fd, sender,
+                                                    false);
+                                  }),
+                   recipients.end());
+}
+
+/**
+ * Send a channel message
+ * @param client_fd: publisher's connection
+ * @param channel: channel name
+ * @param msg: message text, newline-terminated
+ * Encoded once and handed to the batched fanout under "!<channel>"; the
+ * observer list is used as the recipient vector without filtering.
+ */
+void ChatServer::send_channel_message(int client_fd, const std::string &channel,
+                                      const std::string &msg) {
+  topSenders.record(fdTousername[client_fd], msg.size());
+  topGroups.record("!" + channel, msg.size());
+  topRecipients.record("!" + channel, msg.size(),
+                       channels[channel].observers.size());
+  std::string s_message =
+      LIGHT_CYAN + "[ Channel " + channel + " ]" + RESET + " : " + msg;
+  schedule_fanout("!" + channel, channels[channel].observers, s_message);
+}
+
+/**
+ * Send a group message
+ * @param client_fd: sender's connection, or 0 if the sender is offline
+ *                   (scheduled messages)
+ * @param sender: sender's username
+ * @param group: group name
+ * @param msg: message text, newline-terminated
+ * Journals the message and hands it to the fanout, in push or pull mode,
+ * minus members who muted the sender and digest subscribers.
+ */
+void ChatServer::send_group_message(int client_fd, const std::string &sender,
+                                    const std::string &group,
+                                    const std::string &msg) {
+  topSenders.record(sender, msg.size());
+  topGroups.record(group, msg.size());
+  // The frame is the same for every member, so encode it once.
+  std::string s_message =
+      LIGHT_CYAN + "[ Group " + group + " ]" + RESET + " : " + msg;
+  const std::unordered_set<int> &members = groupTofd[group];
+  GroupDelivery &delivery = groupDelivery[group];
+  int64_t now = now_ms();
+  std::vector<int> recipients;
+  size_t reading = 0;
+  if (delivery.pull) {
+    // Only members who are reading get the message now. The reader set
+    // holds members that became active since the group switched, and
+    // loses them here once they go idle or leave.
+    std::unordered_set<int> &readers = groupReaders[group];
+    for (auto it = readers.begin(); it != readers.end();) {
+      if (!is_reading(*it, now) || members.count(*it) == 0) {
+        it = readers.erase(it);
+        continue;
+      }
+      if (*it != client_fd)
+        recipients.push_back(*it);
+      ++it;
+    }
+    reading = recipients.size();
+  } else {
+    for (int receiver_fd : members) {
+      if (receiver_fd == client_fd)
+        continue;
+      recipients.push_back(receiver_fd);
+      if (is_reading(receiver_fd, now))
+        ++reading;
+    }
+  }
+  std::string key = "g:" + group;
+  uint64_t sender_hash = user_hash(sender);
+  uint64_t seq = journal_message(key, s_message, sender_hash);
+  std::string tagged = tag_record(seq, key, s_message);
+  if (delivery.pull) {
+    std::unordered_map<std::string, uint64_t> &cursors = readCursors[group];
+    cursors[sender] = seq;
+    for (int receiver_fd : recipients)
+      cursors[fdTousername[receiver_fd]] = seq;
+  }
+  drop_muted(recipients, sender_hash);
+  topRecipients.record("#" + group, msg.size(), recipients.size());
+  // Digest subscribers get the message with their next digest.
+  if (!digests.empty()) {
+    std::shared_ptr<const std::string> text;
+    auto digested = std::stable_partition(
+        recipients.begin(), recipients.end(),
+        [this, &group](int receiver_fd) {
+          return !wants_digest(receiver_fd, group);
+        });
+    for (auto it = digested; it != recipients.end(); ++it) {
+      if (!text)
+        text = std::make_shared<const std::string>(s_message);
+      add_to_digest(*it, group, seq, text);
+    }
+    recipients.erase(digested, recipients.end());
+  }
+  schedule_fanout(group, recipients, s_message, tagged);
+  update_delivery_mode(group, seq, reading,
+                       members.size() - members.count(client_fd));
+  if (syncClients.count(client_fd) > 0)
+    send_to(client_fd, tagged, Lane::BULK);
+}
+
+/**
+ * Send a direct message
+ * @param client_fd: sender's connection, or 0 if the sender is offline
+ *                   (scheduled messages)
+ * @param sender: sender's username
+ * @param receiver: recipient's username; offline recipients get it with
+ *                  their next /sync
+ * @param msg: message text, newline-terminated
+ * Messages to a recipient who blocked the sender are dropped without
+ * telling the sender.
+ */
+void ChatServer::send_direct_message(int client_fd, const std::string &sender,
+                                     const std::string &receiver,
+                                     const std::string &msg) {
+  uint64_t sender_hash = user_hash(sender);
+  auto list = muteLists.find(receiver);
+  if (list != muteLists.end() && list->second.blocks(sender_hash))
+    return;
+  auto online = usernameTofd.find(receiver);
+  topSenders.record(sender, msg.size());
+  topRecipients.record(receiver, msg.size());
+  std::string s_message = "[ " + sender + " ] : " + msg;
+  std::string key = dm_key(sender, receiver);
+  uint64_t seq = journal_message(key, s_message, sender_hash);
+  std::string tagged = tag_record(seq, key, s_message);
+  if (online != usernameTofd.end())
+    send_to(online->second,
+            syncClients.count(online->second) > 0 ? tagged : s_message);
+  if (syncClients.count(client_fd) > 0)
+    send_to(client_fd, tagged, Lane::BULK);
+}
+
+/**
+ * Schedule a message
+ * @param client_fd: requesting client
+ * @param args: "<delay|time> <username|#group> <message>"
+ * A delay is a number of seconds, optionally with an s, m, h or d suffix;
+ * a time is HH:MM (the next such local time) or @<unix seconds>. The
+ * message is journaled as a SCHEDULE record, whose sequence number is its
+ * id, and added to the schedule wheel.
+ */
+void ChatServer::schedule_message(int client_fd, const std::string &args) {
+  std::stringstream ss(args);
+  std::string when, target, msg, server_message;
+  ss >> when >> target;
+  std::getline(ss, msg);
+  strip_input(msg);
+  const std::string &username = fdTousername[client_fd];
+
+  int64_t now = unix_ms();
+  int64_t due = -1;
+  int hour, minute;
+  char suffix = 's';
+  char extra;
+  if (when.size() > 1 && when[0] == '@' && when.size() < 13 &&
+      when.find_first_not_of("0123456789", 1) == std::string::npos) {
+    due = std::stoll(when.substr(1)) * 1000;
+  } else if (sscanf(when.c_str(), "%d:%d%c", &hour, &minute, &extra) == 2 &&
+             hour >= 0 && hour < 24 && minute >= 0 && minute < 60) {
+    time_t t = now / 1000;
+    struct tm local;
+    localtime_r(&t, &local);
+    local.tm_hour = hour;
+    local.tm_min = minute;
+    local.tm_sec = 0;
+    due = static_cast<int64_t>(mktime(&local)) * 1000;
+    if (due <= now)
+      due += 86400 * 1000LL;
+  } else if (!when.empty() && when.size() < 10 &&
+             isdigit(static_cast<unsigned char>(when[0]))) {
+    size_t digits = when.find_first_not_of("0123456789");
+    if (digits != std::string::npos) {
+      suffix = when[digits];
+      if (digits + 1 != when.size())
+        suffix = '?';
+    }
+    int64_t scale = suffix == 's' ? 1 : suffix == 'm' ? 60
+                  : suffix == 'h' ? 3600 : suffix == 'd' ? 86400 : 0;
+    if (scale > 0)
+      due = now + std::stoll(when.substr(0, digits)) * scale * 1000;
+  }
+
+  size_t pending = 0;
+  for (const auto &entry : scheduled) {
+    if (entry.second.sender == username)
+      ++pending;
+  }
+  bool group = !target.empty() && target[0] == '#';
+  if (due < 0 || target.empty() || msg.empty()) {
+    server_message = "Usage: /schedule <delay|time> <username|#groupname> "
+                     "<message>\n";
+    send_server_error(client_fd, server_message);
+  } else if (due > now + MAX_SCHEDULE_AHEAD_MS) {
+    server_message = "Messages can be scheduled at most " +
+                     std::to_string(MAX_SCHEDULE_AHEAD_MS / 86400000) +
+                     " days ahead\n";
+    send_server_error(client_fd, server_message);
+  } else if (pending >= MAX_SCHEDULED_PER_USER) {
+    server_message = "Too many scheduled messages\n";
+    send_server_error(client_fd, server_message);
+  } else if (group && userGroups[username].count(target.substr(1)) == 0) {
+    server_message = "Not a member of the group\n";
+    send_server_error(client_fd, server_message);
+  } else if (!group && (credentials.count(target) == 0 || target == username)) {
+    server_message = "User not found\n";
+    send_server_error(client_fd, server_message);
+  } else {
+    std::string text = std::to_string(due) + " " + target + " " + msg + "\n";
+    uint64_t seq = journal.append(RecordKind::SCHEDULE, username, text);
+    apply_record(JournalRecord{seq, 0, RecordKind::SCHEDULE, username, text,
+                               0, 0});
+    scheduleWheel.add(seq, due);
+
+    time_t t = due / 1000;
+    struct tm local;
+    char stamp[32];
+    localtime_r(&t, &local);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+    server_message = "Scheduled message " + std::to_string(seq) + " for " +
+                     stamp + "\n";
+    send_server(client_fd, server_message);
+  }
+}
+
+/**
+ * Send the scheduled messages that are due
+ * Called on every timer tick. All messages due in the same second are
+ * sent in one pass and retired with a single SCHEDULE_DONE record.
+ * Messages whose sender has left the group are dropped.
+ */
+void ChatServer::run_scheduled() {
+  std::vector<uint64_t> due = scheduleWheel.advance(unix_ms());
+  if (due.empty())
+    return;
+  std::string done;
+  for (uint64_t id : due) {
+    auto it = scheduled.find(id);
+    if (it == scheduled.end())
+      continue; // cancelled
+    const ScheduledMessage &message = it->second;
+    auto online = usernameTofd.find(message.sender);
+    int sender_fd = online == usernameTofd.end() ? 0 : online->second;
+    if (message.target[0] == '#') {
+      std::string group = message.target.substr(1);
+      if (groupTofd.count(group) > 0 &&
+          userGroups[message.sender].count(group) > 0)
+        send_group_message(sender_fd, message.sender, group, message.text);
+    } else {
+      send_direct_message(sender_fd, message.sender, message.target,
+                          message.text);
+    }
+    done += (done.empty() ? "" : " ") + std::to_string(id);
+  }
+  if (done.empty())
+    return;
+  uint64_t seq = journal.append(RecordKind::SCHEDULE_DONE, "", done);
+  apply_record(JournalRecord{seq, 0, RecordKind::SCHEDULE_DONE, "", done, 0, 0});
+}
+
+/**
+ * Handle client message
+ * @param client_fd: client file descriptor
+ * Read message from client and process it
+ */
+void ChatServer::handle_client_message(int client_fd) {
+  char buf[BUF_SIZE];
+  ssize_t nbytes;
+
+  if (clients.find(client_fd) == clients.end() &&
+      sessions.find(client_fd) == sessions.end() &&
+      gateways.find(client_fd) == gateways.end() &&
+      webSockets.find(client_fd) == webSockets.end() &&
+      observers.find(client_fd) == observers.end()) {
+    std::cerr << "Invalid client_fd: " << client_fd << std::endl;
+    return;
+  }
+
+  struct iovec iov = {buf, sizeof(buf) - 1};
+  char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  // Edge-triggered: read until the socket is drained.
+  while ((nbytes = recvmsg(client_fd, &msg, 0)) > 0) {
+    buf[nbytes] = '\0';
+
+    receivedAtUs = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET &&
+          cmsg->cmsg_type == SCM_TIMESTAMPING) {
+        struct scm_timestamping ts;
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+        receivedAtUs = ts.ts[0].tv_sec * 1000000LL + ts.ts[0].tv_nsec / 1000;
+      }
+    }
+    if (receivedAtUs == 0)
+      receivedAtUs = unix_us();
+
+    // Any inbound data proves the peer is alive.
+    Connection &conn = connections[client_fd];
+    conn.lastActivity = now_ms();
+    conn.pingToken = 0;
+
+    if (observers.find(client_fd) != observers.end()) {
+      msg.msg_controllen = sizeof(control);
+      continue; // observers only receive
+    }
+    std::string data(buf, nbytes);
+    if (gateways.find(client_fd) != gateways.end()) {
+      handle_gateway_data(client_fd, data);
+    } else if (webSockets.find(client_fd) != webSockets.end()) {
+      handle_websocket_data(client_fd, data);
+    } else {
+      conn.inbuf += data;
+      handle_input(client_fd);
+    }
+    if (connections.find(client_fd) == connections.end())
+      return; // closed by a command (CLOSE, failed login, ...)
+    msg.msg_controllen = sizeof(control);
+  }
+
+  if (nbytes == 0) {
+    std::cout << "Socket " << client_fd << " hung up" << std::endl;
+  } else if (nbytes < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
+    if (errno == EBADF) {
+      return;
+    }
+    perror("recv");
+  }
+
+  // Clean up if the connection was closed.
+  if (nbytes == 0 || (nbytes < 0 && errno != EWOULDBLOCK && errno != EAGAIN)) {
+    disconnect_client(client_fd);
+  }
+}
+
+/**
+ * Handle input
+ * @param client_fd: plain TCP client with new data in its input buffer
+ * Run every complete line. A line longer than MAX_MESSAGE_SIZE is dropped
+ * with an error. A chat message that grows past STREAM_THRESHOLD before its
+ * newline arrives is streamed to its recipients chunk by chunk.
  */
-void send_server(int client_fd, std::string &message) {
-  message = GREEN + message + RESET;
-  send(client_fd, message.c_str(), message.size(), 0);
+void ChatServer::handle_input(int client_fd) {
+  Connection &conn = connections[client_fd];
+  size_t start = 0;
+  while (start < conn.inbuf.size()) {
+    size_t newline = conn.inbuf.find('\n', start);
+    size_t end = newline == std::string::npos ? conn.inbuf.size() : newline;
+
+    if (streams.find(client_fd) != streams.end()) {
+      stream_chunk(client_fd, conn.inbuf.substr(start, end - start));
+      if (newline != std::string::npos) {
+        if (streams.count(client_fd) > 0)
+          finish_stream(client_fd);
+        else
+          conn.discarding = false; // aborted, and the line is over anyway
+      }
+      start = newline == std::string::npos ? end : newline + 1;
+      continue;
+    }
+    if (conn.discarding) {
+      conn.discarding = newline == std::string::npos;
+      start = newline == std::string::npos ? end : newline + 1;
+      continue;
+    }
+    if (end - start > MAX_MESSAGE_SIZE) {
+      std::string error = "Message too long (limit " +
+                          std::to_string(MAX_MESSAGE_SIZE) + " bytes)\n";
+      send_server_error(client_fd, error);
+      conn.discarding = newline == std::string::npos;
+      start = newline == std::string::npos ? end : newline + 1;
+      continue;
+    }
+    if (newline == std::string::npos) {
+      if (end - start >= STREAM_THRESHOLD &&
+          clients.find(client_fd) != clients.end() &&
+          start_stream(client_fd, conn.inbuf.substr(start)))
+        start = end;
+      break;
+    }
+
+    std::string line = conn.inbuf.substr(start, newline - start);
+    start = newline + 1;
+    if (!line.empty())
+      handle_line(client_fd, line);
+    if (connections.find(client_fd) == connections.end())
+      return;
+  }
+  conn.inbuf.erase(0, start);
 }
 
-void send_server_error(int client_fd, std::string &message) {
-  message = RED + "Error: " + message + RESET;
-  send(client_fd, message.c_str(), message.size(), 0);
+/**
+ * Start streaming a message
+ * @param client_fd: sender
+ * @param partial: the unterminated line so far
+ * @return: true if the message is now streamed; false leaves it to be
+ *          handled as a whole line (invalid target, no plain TCP
+ *          recipient, or earlier group traffic still queued)
+ */
+bool ChatServer::start_stream(int client_fd, const std::string &partial) {
+  // Left to handle_line(), which refuses the whole line.
+  if (has_control_bytes(partial))
+    return false;
+  std::stringstream ss(partial);
+  std::string command, target;
+  ss >> command;
+  const std::string &sender = fdTousername[client_fd];
+
+  OutStream stream;
+  std::string prefix;
+  std::vector<int> recipients;
+  if (command == "/msg") {
+    ss >> target;
+    auto it = usernameTofd.find(target);
+    if (it == usernameTofd.end() || target == sender)
+      return false;
+    if (is_muted(it->second, user_hash(sender), true))
+      return false;
+    stream.key = dm_key(sender, target);
+    stream.receiver = target;
+    prefix = "[ " + sender + " ] : ";
+    recipients.push_back(it->second);
+  } else if (command == "/group_msg") {
+    ss >> target;
+    auto it = groupTofd.find(target);
+    // Streaming past queued messages of the group would reorder it, and
+    // pull-mode groups do not stream to every member.
+    if (it == groupTofd.end() || fanoutQueues.count(target) > 0 ||
+        groupDelivery[target].pull)
+      return false;
+    stream.key = "g:" + target;
+    stream.group = target;
+    prefix = LIGHT_CYAN + "[ Group " + target + " ]" + RESET + " : ";
+    for (int receiver_fd : it->second) {
+      if (wants_digest(receiver_fd, target))
+        return false;
+      if (receiver_fd != client_fd)
+        recipients.push_back(receiver_fd);
+    }
+  } else if (command == "/broadcast") {
+    if (fanoutQueues.count("*") > 0)
+      return false;
+    stream.key = "b";
+    stream.group = "*";
+    prefix = BLUE + sender + RESET + ": " + GREEN;
+    stream.suffix = RESET;
+    for (int receiver_fd : clients) {
+      if (receiver_fd != client_fd && receiver_fd != listener_fd)
+        recipients.push_back(receiver_fd);
+    }
+  } else {
+    return false;
+  }
+  drop_muted(recipients, user_hash(sender));
+
+  for (int receiver_fd : recipients) {
+    auto conn = connections.find(receiver_fd);
+    bool plain = receiver_fd >= 0 && conn != connections.end() &&
+                 webSockets.count(receiver_fd) == 0 &&
+                 syncClients.count(receiver_fd) == 0 &&
+                 flowControl.count(receiver_fd) == 0 &&
+                 conn->second.streamLock == 0 &&
+                 conn->second.queuedBytes + conn->second.deferredBytes <=
+                     OUTQUEUE_LIMIT;
+    if (plain) {
+      stream.live.push_back(receiver_fd);
+      stream.liveIds.push_back(conn->second.id);
+    } else {
+      stream.later.push_back(receiver_fd);
+    }
+  }
+  if (stream.live.empty())
+    return false;
+
+  std::string body;
+  std::getline(ss, body);
+  body.erase(0, body.find_first_not_of(' '));
+  stream.id = next_stream_id++;
+  stream.text = prefix + body;
+  stream.started = now_ms();
+  stream.lastChunk = stream.started;
+
+  auto head = std::make_shared<const std::string>(stream.text);
+  for (int receiver_fd : stream.live) {
+    Connection &conn = connections[receiver_fd];
+    conn.streamLock = stream.id;
+    enqueue_output(conn, OutItem(head), Lane::BULK);
+  }
+
+  uint64_t id = stream.id;
+  streams[client_fd] = std::move(stream);
+  timers.schedule(STREAM_IDLE_MS,
+                  [this, client_fd, id]() { check_stream(client_fd, id); });
+  return true;
 }
 
 /**
- * Get IP address from sockaddr
- * @param sa: sockaddr
+ * Relay a chunk of a streamed message
+ * @param client_fd: sender
+ * @param chunk: next bytes of the message, without the final newline
+ * All live recipients share one buffer per chunk.
  */
-void *get_in_addr(struct sockaddr *sa) {
+void ChatServer::stream_chunk(int client_fd, const std::string &chunk) {
+  OutStream &stream = streams[client_fd];
+  if (stream.text.size() + chunk.size() > MAX_MESSAGE_SIZE) {
+    abort_stream(client_fd, "Message too long (limit " +
+                                std::to_string(MAX_MESSAGE_SIZE) + " bytes)\n");
+    connections[client_fd].discarding = true;
+    return;
+  }
+  if (chunk.empty())
+    return;
+  // The final chunk may end with the '\r' of a "\r\n" line ending.
+  if (has_control_bytes(chunk.back() == '\r' ? chunk.substr(0, chunk.size() - 1)
+                                              : chunk)) {
+    abort_stream(client_fd, "Control characters are not allowed\n");
+    connections[client_fd].discarding = true;
+    return;
+  }
+  stream.text += chunk;
+  stream.lastChunk = now_ms();
 
-  if (sa->sa_family == AF_INET) {
-    return &(((struct sockaddr_in *)sa)->sin_addr);
+  auto buf = std::make_shared<const std::string>(chunk);
+  for (size_t i = 0; i < stream.live.size(); ++i) {
+    auto conn = connections.find(stream.live[i]);
+    if (conn != connections.end() && conn->second.id == stream.liveIds[i])
+      enqueue_output(conn->second, OutItem(buf), Lane::BULK);
   }
-  return &(((struct sockaddr_in6 *)sa)->sin6_addr);
 }
 
 /**
- * ChatServer constructor
- * Initialize the server
+ * Finish a streamed message
+ * @param client_fd: sender, whose newline has arrived
+ * Ends the message for the live recipients, journals it and delivers it
+ * whole to the remaining recipients.
  */
-void ChatServer::setup_listener() {
-  struct addrinfo hints = {}, *ai, *p;
-  hints.ai_family = AF_UNSPEC;     // Use IPv4 or IPv6, whichever
-  hints.ai_socktype = SOCK_STREAM; // TCP
-  hints.ai_flags = AI_PASSIVE;     // use localhost
+void ChatServer::finish_stream(int client_fd) {
+  OutStream stream = std::move(streams[client_fd]);
+  streams.erase(client_fd);
 
-  int rv = getaddrinfo(nullptr, PORT, &hints, &ai);
-  if (rv != 0) {
-    throw std::runtime_error("getaddrinfo: " + std::string(gai_strerror(rv)));
+  std::string tail = "\n" + stream.suffix;
+  auto buf = std::make_shared<const std::string>(tail);
+  for (size_t i = 0; i < stream.live.size(); ++i) {
+    auto conn = connections.find(stream.live[i]);
+    if (conn != connections.end() && conn->second.id == stream.liveIds[i]) {
+      enqueue_output(conn->second, OutItem(buf), Lane::BULK);
+      release_stream_lock(stream.live[i], stream.id);
+    }
   }
 
-  for (p = ai; p != nullptr; p = p->ai_next) {
-    listener_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-    if (listener_fd == -1) {
-      continue;
+  while (!stream.text.empty() && std::isspace(static_cast<unsigned char>(
+                                     stream.text.back())))
+    stream.text.pop_back();
+  std::string text = stream.text + tail;
+  const std::string &sender = fdTousername[client_fd];
+  topSenders.record(sender, text.size());
+  if (!stream.group.empty() && stream.group != "*")
+    topGroups.record(stream.group, text.size());
+  topRecipients.record(stream.group.empty()
+                           ? stream.receiver
+                           : (stream.group == "*" ? "*" : "#" + stream.group),
+                       text.size(), stream.live.size() + stream.later.size());
+
+  uint64_t seq = journal_message(stream.key, text, user_hash(sender));
+  std::string tagged = tag_record(seq, stream.key, text);
+  if (stream.group.empty()) {
+    for (int receiver_fd : stream.later)
+      send_to(receiver_fd,
+              syncClients.count(receiver_fd) > 0 ? tagged : text);
+  } else {
+    schedule_fanout(stream.group, stream.later, text, tagged);
+  }
+  if (syncClients.count(client_fd) > 0)
+    send_to(client_fd, tagged, Lane::BULK);
+}
+
+/**
+ * Abort a streamed message
+ * @param client_fd: sender
+ * @param reason: error for the sender
+ * Live recipients see the message cut off; it is not journaled and the
+ * other recipients never see it.
+ */
+void ChatServer::abort_stream(int client_fd, const std::string &reason) {
+  OutStream stream = std::move(streams[client_fd]);
+  streams.erase(client_fd);
+
+  auto buf = std::make_shared<const std::string>(
+      " [message truncated]\n" + stream.suffix);
+  for (size_t i = 0; i < stream.live.size(); ++i) {
+    auto conn = connections.find(stream.live[i]);
+    if (conn != connections.end() && conn->second.id == stream.liveIds[i]) {
+      enqueue_output(conn->second, OutItem(buf), Lane::BULK);
+      release_stream_lock(stream.live[i], stream.id);
     }
+  }
+  if (clients.find(client_fd) != clients.end()) {
+    std::string error = reason;
+    send_server_error(client_fd, error);
+  }
+}
 
-    // Allow reusing the same port.
-    int yes = 1;
-    setsockopt(listener_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+/**
+ * Check stream
+ * @param client_fd: sender
+ * @param id: stream the timer was set for
+ * Cut off a stream whose sender stalled, trickles slower than
+ * STREAM_MIN_RATE or runs past STREAM_MAX_MS, so its recipients are not
+ * held back indefinitely.
+ */
+void ChatServer::check_stream(int client_fd, uint64_t id) {
+  auto it = streams.find(client_fd);
+  if (it == streams.end() || it->second.id != id)
+    return;
+  const OutStream &stream = it->second;
+  int64_t now = now_ms();
+  int64_t idle = now - stream.lastChunk;
+  int64_t elapsed = now - stream.started;
+  bool slow = elapsed >= STREAM_IDLE_MS &&
+              static_cast<int64_t>(stream.text.size()) * 1000 <
+                  STREAM_MIN_RATE * elapsed;
+  if (idle < STREAM_IDLE_MS && !slow && elapsed < STREAM_MAX_MS) {
+    int64_t next = std::min(STREAM_IDLE_MS - idle, STREAM_MAX_MS - elapsed);
+    if (elapsed < STREAM_IDLE_MS)
+      next = std::min(next, STREAM_IDLE_MS - elapsed);
+    else
+      next = std::min<int64_t>(next, 1000);
+    timers.schedule(next,
+                    [this, client_fd, id]() { check_stream(client_fd, id); });
+    return;
+  }
+  abort_stream(client_fd, idle >= STREAM_IDLE_MS
+                              ? "Message timed out before its end\n"
+                              : "Message sent too slowly\n");
+  connections[client_fd].discarding = true;
+}
 
-    if (bind(listener_fd, p->ai_addr, p->ai_addrlen) == -1) {
-      close(listener_fd);
+/**
+ * Release stream lock
+ * @param client_fd: recipient
+ * @param id: stream that has ended
+ * Queue the output that was held back while the stream was written, on
+ * the bulk lane behind the stream's own chunks so it cannot overtake them.
+ */
+void ChatServer::release_stream_lock(int client_fd, uint64_t id) {
+  Connection &conn = connections[client_fd];
+  if (conn.streamLock != id)
+    return;
+  conn.streamLock = 0;
+  std::deque<std::pair<OutItem, Lane>> deferred;
+  deferred.swap(conn.deferred);
+  conn.deferredBytes = 0;
+  for (auto &entry : deferred)
+    enqueue_output(conn, std::move(entry.first), Lane::BULK);
+}
+
+/**
+ * Leave stream
+ * @param client_fd: live recipient of a stream that needs control output
+ * The recipient sees its copy cut off and gets the whole message with
+ * the other late recipients when the stream ends.
+ */
+void ChatServer::leave_stream(int client_fd) {
+  Connection &conn = connections[client_fd];
+  uint64_t id = conn.streamLock;
+  std::string suffix;
+  for (auto &entry : streams) {
+    OutStream &stream = entry.second;
+    if (stream.id != id)
       continue;
+    for (size_t i = 0; i < stream.live.size(); ++i) {
+      if (stream.live[i] == client_fd && stream.liveIds[i] == conn.id) {
+        stream.live.erase(stream.live.begin() + i);
+        stream.liveIds.erase(stream.liveIds.begin() + i);
+        stream.later.push_back(client_fd);
+        break;
+      }
     }
-
+    suffix = stream.suffix;
     break;
   }
+  enqueue_output(conn,
+                 OutItem(std::make_shared<const std::string>(
+                     " [message continues below]\n" + suffix)),
+                 Lane::BULK);
+  release_stream_lock(client_fd, id);
+}
 
-  freeaddrinfo(ai);
+/**
+ * Handle line
+ * @param client_fd: client file descriptor or logical session id
+ * @param data: one message from the client
+ * Drive the login state machine, or run the command once authenticated.
+ */
+void ChatServer::handle_line(int client_fd, const std::string &data) {
+  // If we have a session waiting for authentication, use that buffer.
+  if (sessions.find(client_fd) != sessions.end()) {
+    ClientSession &session = sessions[client_fd];
 
-  if (p == nullptr) {
-    throw std::runtime_error("Failed to bind listener socket");
+    // Directly process the received data as a complete message.
+    std::string line(data);
+    strip_input(line);
+
+    if (session.state == ClientState::WAITING_USERNAME) {
+      if (client_fd >= 0 && webSockets.find(client_fd) == webSockets.end() &&
+          line.compare(0, 8, "GATEWAY ") == 0) {
+        open_gateway(client_fd, line.substr(8));
+        return;
+      }
+      if (client_fd >= 0 && webSockets.find(client_fd) == webSockets.end() &&
+          line.compare(0, 8, "OBSERVE ") == 0) {
+        open_observer(client_fd, line.substr(8));
+        return;
+      }
+      session.usernameCandidate = line;
+      std::string prompt = "Enter the password:\n";
+      send_to(client_fd, prompt);
+      session.state = ClientState::WAITING_PASSWORD;
+
+    } else if (session.state == ClientState::WAITING_PASSWORD) {
+      // Checked with the rest of this iteration's logins.
+      session.state = ClientState::AUTHENTICATING;
+      queue_login(client_fd, session.usernameCandidate, line);
+    }
   }
 
-  if (listen(listener_fd, 10) == -1) {
-    throw std::runtime_error("listen failed");
+  // If the client is already authenticated, process commands.
+  else if (clients.find(client_fd) != clients.end()) {
+    std::string message(data);
+    strip_input(message);
+    process_authenticated_message(client_fd, message);
   }
+}
 
-  // Set listener_fd to non-blocking.
-  int flags = fcntl(listener_fd, F_GETFL, 0);
-  fcntl(listener_fd, F_SETFL, flags | O_NONBLOCK);
+/**
+ * Queue login
+ * @param client_fd: client file descriptor or logical session id
+ * @param username: username entered
+ * @param password: password entered
+ */
+void ChatServer::queue_login(int client_fd, const std::string &username,
+                             const std::string &password) {
+  auto it = connections.find(client_fd);
+  pendingLogins.push_back(PendingLogin{
+      client_fd, it == connections.end() ? 0 : it->second.id, username,
+      password});
+}
 
-  std::cout << "Server is ready and waiting for connections on " << PORT
-            << std::endl;
+/**
+ * Process logins
+ * Check up to LOGIN_BATCH queued logins against one snapshot of the
+ * credentials, then announce everyone who joined in a single broadcast.
+ * After a restart every client reconnects at once; the batch bound keeps
+ * already connected clients served in between.
+ */
+void ChatServer::process_logins() {
+  if (pendingLogins.empty())
+    return;
+  reload_credentials();
 
-  // Create epoll instance.
-  epoll_fd = epoll_create1(0);
-  if (epoll_fd == -1) {
-    throw std::runtime_error("epoll_create1 failed");
+  std::vector<std::string> joined;
+  std::vector<int> joinedFds;
+  for (size_t n = 0; n < LOGIN_BATCH && !pendingLogins.empty(); ++n) {
+    PendingLogin login = std::move(pendingLogins.front());
+    pendingLogins.pop_front();
+
+    // The client may have gone away while queued.
+    bool alive = login.fd < 0
+                     ? logicalSessions.count(login.fd) > 0
+                     : (connections.count(login.fd) > 0 &&
+                        connections[login.fd].id == login.connectionId);
+    if (!alive)
+      continue;
+
+    if (perform_authentication(login.username, login.password, login.fd) ==
+        SUCCESS) {
+      sessions.erase(login.fd);
+      complete_login(login.fd, login.username);
+      joined.push_back(login.username);
+      joinedFds.push_back(login.fd);
+    } else {
+      std::string failMsg = "Authentication failed\n";
+      send_to(login.fd, failMsg);
+      disconnect_client(login.fd);
+    }
   }
 
-  struct epoll_event ev = {};
-  ev.events = EPOLLIN; // Read events
-  ev.data.fd = listener_fd;
+  if (joined.size() == 1) {
+    std::string joinMsg = joined[0] + " has joined the chat\n";
+    broadcast_message(joinMsg.c_str(), joinMsg.size(), joinedFds[0], true);
+  } else if (!joined.empty()) {
+    std::string joinMsg;
+    size_t listed = joined.size() <= 5 ? joined.size() - 1 : 3;
+    for (size_t i = 0; i < listed; ++i)
+      joinMsg += (i ? ", " : "") + joined[i];
+    if (listed == joined.size() - 1)
+      joinMsg += " and " + joined.back();
+    else
+      joinMsg += " and " + std::to_string(joined.size() - listed) + " others";
+    joinMsg += " have joined the chat\n";
+    // listener_fd is never a recipient, so nobody is excluded.
+    broadcast_message(joinMsg.c_str(), joinMsg.size(), listener_fd, true);
+  }
+}
 
-  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener_fd, &ev) == -1) {
-    throw std::runtime_error("epoll_ctl: listener_fd failed");
+/**
+ * Reload credentials
+ * Re-read users.txt only when its modification time changed, so a login
+ * storm reads the file once instead of once per login.
+ */
+void ChatServer::reload_credentials() {
+  struct stat st;
+  if (stat(FILENAME, &st) == -1) {
+    credentials.clear();
+    return;
   }
+  int64_t mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  if (mtime == credentialsMtime && !credentials.empty())
+    return;
+
+  std::ifstream userfile(FILENAME);
+  if (!userfile.is_open()) {
+    std::cerr << "error opening " << FILENAME << std::endl;
+    return;
+  }
+  credentials.clear();
+  std::string line;
+  while (std::getline(userfile, line)) {
+    size_t colon_pos = line.find(":");
+    if (colon_pos != std::string::npos) {
+      std::string stored_username = line.substr(0, colon_pos);
+      std::string stored_password = line.substr(colon_pos + 1);
+      strip_input(stored_username);
+      strip_input(stored_password);
+      credentials[stored_username] = stored_password;
+    }
+  }
+  credentialsMtime = mtime;
 }
 
 /**
- * Handle new connection
- * Accept new connection and add to epoll
+ * Complete login
+ * @param client_fd: client file descriptor or logical session id
+ * @param username: authenticated username
+ * Register the user and welcome it; process_logins() announces it.
  */
+void ChatServer::complete_login(int client_fd, const std::string &username) {
+  clients.insert(client_fd);
+  fdTousername[client_fd] = username;
+  usernameTofd[username] = client_fd;
+  activeUsernames.insert(username);
+  onlineListing.insert(username);
+  refresh_muter(username);
 
-void ChatServer::handle_new_connection() {
-  struct sockaddr_storage remoteaddr;
-  socklen_t addrlen = sizeof(remoteaddr);
-  char remoteIP[INET6_ADDRSTRLEN];
+  // Group memberships outlive the connection.
+  for (const std::string &group : userGroups[username]) {
+    groupTofd[group].insert(client_fd);
+    fdTogroups[client_fd].insert(group);
+  }
 
-  int new_fd = accept(listener_fd, (struct sockaddr *)&remoteaddr, &addrlen);
-  if (new_fd == -1) {
-    perror("accept");
-    return;
+  std::string welcome = GREEN + "Welcome to the chat server!\n" + RESET;
+  send_to(client_fd, welcome);
+}
+
+/**
+ * Read gateway credentials
+ * @return: name -> secret for each "<name>:<secret>" line of gateways.txt;
+ *          blank lines and lines starting with '#' are skipped
+ */
+std::vector<std::pair<std::string, std::string>> read_gateways() {
+  std::vector<std::pair<std::string, std::string>> entries;
+  std::ifstream gatewayfile(GATEWAYS_FILE);
+  std::string line;
+  while (std::getline(gatewayfile, line)) {
+    strip_input(line);
+    size_t pos = line.find(':');
+    if (line.empty() || line[0] == '#' || pos == std::string::npos)
+      continue;
+    std::string stored_name = line.substr(0, pos);
+    std::string stored_secret = line.substr(pos + 1);
+    strip_input(stored_name);
+    strip_input(stored_secret);
+    entries.emplace_back(stored_name, stored_secret);
   }
+  return entries;
+}
 
-  // Print remote client info.
-  std::cout << "New connection from "
-            << inet_ntop(remoteaddr.ss_family,
-                         get_in_addr((struct sockaddr *)&remoteaddr), remoteIP,
-                         INET6_ADDRSTRLEN)
-            << " on socket " << new_fd << std::endl;
+/**
+ * Whether a gateway secret is unfit for use
+ * @param secret: secret from gateways.txt
+ * Placeholder secrets (like the one in gateways.txt.example) and short
+ * ones are refused.
+ */
+bool weak_gateway_secret(const std::string &secret) {
+  static const std::unordered_set<std::string> placeholders = {
+      "changeme", "secret", "password", "gateway"};
+  return secret.size() < GATEWAY_SECRET_MIN || placeholders.count(secret) > 0;
+}
 
-  // Set new_fd to non-blocking.
-  int flags = fcntl(new_fd, F_GETFL, 0);
-  fcntl(new_fd, F_SETFL, flags | O_NONBLOCK);
+/**
+ * Check gateways.txt before accepting connections
+ * Throws if any gateway has a placeholder or short secret, so a server is
+ * never started with credentials copied from the example file. A missing
+ * file just means no gateways.
+ */
+void check_gateways() {
+  for (const auto &entry : read_gateways())
+    if (weak_gateway_secret(entry.second))
+      throw std::runtime_error(
+          std::string(GATEWAYS_FILE) + ": gateway " + entry.first +
+          " has a default or short secret (at least " +
+          std::to_string(GATEWAY_SECRET_MIN) + " characters required)");
+}
 
+/**
+ * Whether a gateway session id can be framed
+ * @param sid: session id chosen by the gateway
+ * Outbound frames are "@<sid>[,<sid>...] <length>", so ids are limited to
+ * letters, digits, '-', '_' and '.'.
+ */
+bool valid_sid(const std::string &sid) {
+  if (sid.empty() || sid.size() > GATEWAY_SID_MAX)
+    return false;
+  for (char ch : sid)
+    if (!isalnum(static_cast<unsigned char>(ch)) && ch != '-' && ch != '_' &&
+        ch != '.')
+      return false;
+  return true;
+}
 
-  ClientSession session;
-  session.fd = new_fd;
-  session.state = ClientState::WAITING_USERNAME;
-  sessions[new_fd] = session;
+/**
+ * Open gateway
+ * @param client_fd: connection that sent "GATEWAY <name>:<secret>"
+ * @param credentials: "<name>:<secret>"
+ * Switch the connection to the gateway protocol if the credentials match
+ * an entry of gateways.txt with an acceptable secret.
+ */
+void ChatServer::open_gateway(int client_fd, const std::string &credentials) {
+  size_t colon_pos = credentials.find(':');
+  std::string name = credentials.substr(0, colon_pos);
+  std::string secret =
+      colon_pos == std::string::npos ? "" : credentials.substr(colon_pos + 1);
 
-  std::string prompt = "Enter the username:\n";
-  send(new_fd, prompt.c_str(), prompt.size(), 0);
+  bool valid = false;
+  for (const auto &entry : read_gateways())
+    valid = valid || (!name.empty() && entry.first == name &&
+                      entry.second == secret &&
+                      !weak_gateway_secret(entry.second));
 
-  // Add to epoll.
-  struct epoll_event ev = {};
-  ev.events = EPOLLIN | EPOLLET;
-  ev.data.fd = new_fd;
-  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
-    perror("epoll_ctl: add new_fd");
-    close(new_fd);
-    sessions.erase(new_fd);
+  if (!valid) {
+    std::string failMsg = "Authentication failed\n";
+    send_to(client_fd, failMsg);
+    disconnect_client(client_fd);
+    return;
   }
+
+  sessions.erase(client_fd);
+  gateways[client_fd].name = name;
+  std::cout << "Socket " << client_fd << " is gateway " << name << std::endl;
+  std::string ok = "GATEWAY OK\n";
+  send_to(client_fd, ok);
 }
 
 /**
- * Handle client message
+ * Turn a connection into a channel observer
  * @param client_fd: client file descriptor
- * Read message from client and process it
+ * @param args: "<channel> <username> <password>"
+ * The credentials are checked once; the connection then keeps only its
+ * output queue and a slot in the channel. Its input is read and dropped.
  */
-void ChatServer::handle_client_message(int client_fd) {
-  char buf[BUF_SIZE];
-  ssize_t nbytes;
-
-  if (clients.find(client_fd) == clients.end() &&
-      sessions.find(client_fd) == sessions.end()) {
-    std::cerr << "Invalid client_fd: " << client_fd << std::endl;
+void ChatServer::open_observer(int client_fd, const std::string &args) {
+  std::stringstream ss(args);
+  std::string name, username, password;
+  ss >> name >> username >> password;
+  reload_credentials();
+  auto known = credentials.find(username);
+  if (known == credentials.end() || known->second != password) {
+    std::string failMsg = "Authentication failed\n";
+    send_to(client_fd, failMsg);
+    disconnect_client(client_fd);
+    return;
+  }
+  auto it = channels.find(name);
+  if (it == channels.end()) {
+    std::string server_message = "Channel not found\n";
+    send_server_error(client_fd, server_message);
+    disconnect_client(client_fd);
     return;
   }
 
-  if ((nbytes = recv(client_fd, buf, sizeof(buf), 0)) > 0) {
-    buf[nbytes] = '\0';
-    std::string data(buf);
+  sessions.erase(client_fd);
+  Channel &channel = it->second;
+  observers[client_fd] = ObserverRef{&channel, channel.observers.size()};
+  channel.observers.push_back(client_fd);
+  Connection &conn = connections[client_fd];
+  conn.inbuf.clear();
+  conn.inbuf.shrink_to_fit();
+  std::string ok = "OBSERVING " + name + "\n";
+  send_to(client_fd, ok);
+}
 
-    // If we have a session waiting for authentication, use that buffer.
-    if (sessions.find(client_fd) != sessions.end()) {
-      ClientSession &session = sessions[client_fd];
+/**
+ * Handle gateway data
+ * @param gateway_fd: gateway connection
+ * @param data: bytes received
+ * Inbound gateway lines are "<sid> LOGIN <username> <password>",
+ * "<sid> <command>" for a logged in session, or "<sid> CLOSE".
+ */
+void ChatServer::handle_gateway_data(int gateway_fd, const std::string &data) {
+  Gateway &gateway = gateways[gateway_fd];
+  gateway.inbuf += data;
 
-      // Directly process the received data as a complete message.
-      std::string line(data);
-      strip_input(line);
+  size_t newline;
+  while ((newline = gateway.inbuf.find('\n')) != std::string::npos) {
+    std::string line = gateway.inbuf.substr(0, newline);
+    gateway.inbuf.erase(0, newline + 1);
+    strip_input(line);
 
-      if (session.state == ClientState::WAITING_USERNAME) {
-        session.usernameCandidate = line;
-        std::string prompt = "Enter the password:\n";
-        send(client_fd, prompt.c_str(), prompt.size(), 0);
-        session.state = ClientState::WAITING_PASSWORD;
-
-      } else if (session.state == ClientState::WAITING_PASSWORD) {
-        std::string password = line;
-        int auth_result = perform_authentication(session.usernameCandidate,
-                                                 password, client_fd);
-        if (auth_result == SUCCESS) {
-          session.state = ClientState::AUTHENTICATED;
-
-          clients.insert(client_fd);
-          fdTousername[client_fd] = session.usernameCandidate;
-          usernameTofd[session.usernameCandidate] = client_fd;
-          activeUsernames.insert(session.usernameCandidate);
-
-          std::string welcome = GREEN + "Welcome to the chat server!\n" + RESET;
-          send(client_fd, welcome.c_str(), welcome.size(), 0);
-
-          std::string joinMsg =
-              session.usernameCandidate + " has joined the chat\n";
-          broadcast_message(joinMsg.c_str(), joinMsg.size(), client_fd, true);
-
-          sessions.erase(client_fd);
-        } else {
-          std::string failMsg = "Authentication failed\n";
-          send(client_fd, failMsg.c_str(), failMsg.size(), 0);
-          sessions.erase(client_fd);
-          close(client_fd);
-          return;
-        }
-      }
+    size_t space = line.find(' ');
+    if (line.empty() || space == std::string::npos)
+      continue;
+    std::string sid = line.substr(0, space);
+    std::string payload = line.substr(space + 1);
+    // An id that cannot be framed cannot be answered either; drop the line.
+    if (!valid_sid(sid))
+      continue;
+
+    auto known = gateway.sidToSession.find(sid);
+    if (known != gateway.sidToSession.end()) {
+      handle_line(known->second, payload);
+      continue;
     }
 
-    // If the client is already authenticated, process commands.
-    else if (clients.find(client_fd) != clients.end()) {
-      std::string message(data);
-      strip_input(message);
-      process_authenticated_message(client_fd, message);
+    std::stringstream ss(payload);
+    std::string command, username, password;
+    ss >> command >> username >> password;
+    if (command != "LOGIN") {
+      // Unknown session: tell the gateway it has to log in first.
+      std::string closed = "CLOSED " + sid + "\n";
+      queue_output(gateway_fd, closed, Lane::CONTROL);
+      continue;
     }
+
+    int session_id = next_logical_session--;
+    logicalSessions[session_id] = LogicalSession{gateway_fd, sid};
+    gateway.sidToSession[sid] = session_id;
+
+    queue_login(session_id, username, password);
   }
 
-  if (nbytes == 0) {
-    std::cout << "Socket " << client_fd << " hung up" << std::endl;
-  } else if (nbytes < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
-    if (errno == EBADF) {
-      return;
+  // A gateway line is never longer than one command.
+  if (gateway.inbuf.size() > MAX_MESSAGE_SIZE + BUF_SIZE)
+    gateway.inbuf.clear();
+}
+
+/**
+ * Disconnect client
+ * @param client_fd: client file descriptor
+ * Remove the client from every user and group structure, inform the others
+ * if it was logged in, and close the socket.
+ */
+void ChatServer::disconnect_client(int client_fd) {
+  if (clients.find(client_fd) != clients.end()) {
+    std::string username = fdTousername[client_fd];
+    activeUsernames.erase(username);
+    onlineListing.erase(username);
+    usernameTofd.erase(username);
+    fdTousername.erase(client_fd);
+    onlineMuters.erase(client_fd);
+    clients.erase(client_fd);
+
+    for (const std::string &group : fdTogroups[client_fd]) {
+      auto it = groupTofd.find(group);
+      if (it != groupTofd.end())
+        it->second.erase(client_fd);
     }
-    perror("recv");
-  }
+    fdTogroups.erase(client_fd);
 
-  // Clean up if the connection was closed.
-  if (nbytes == 0 || (nbytes < 0 && errno != EWOULDBLOCK && errno != EAGAIN)) {
-    if (clients.find(client_fd) != clients.end()) {
-      // Inform others that the user left.
-      std::string leftMsg = fdTousername[client_fd] + " has left the chat\n";
-      broadcast_message(leftMsg.c_str(), leftMsg.size(), client_fd, true);
+    // Inform others that the user left.
+    std::string leftMsg = username + " has left the chat\n";
+    broadcast_message(leftMsg.c_str(), leftMsg.size(), client_fd, true);
+  }
+  if (streams.find(client_fd) != streams.end())
+    abort_stream(client_fd, "");
+  sessions.erase(client_fd);
+  syncClients.erase(client_fd);
+  activeReaders.erase(client_fd);
+  digests.erase(client_fd);
+  pendingEphemeral.erase(client_fd);
+  flowControl.erase(client_fd);
 
-      activeUsernames.erase(fdTousername[client_fd]);
-      usernameTofd.erase(fdTousername[client_fd]);
-      fdTousername.erase(client_fd);
-      clients.erase(client_fd);
+  if (client_fd < 0) {
+    // Logical session: tell the gateway, the connection itself stays open.
+    auto it = logicalSessions.find(client_fd);
+    if (it != logicalSessions.end()) {
+      std::string closed = "CLOSED " + it->second.sid + "\n";
+      queue_output(it->second.gatewayFd, closed, Lane::CONTROL);
+      gateways[it->second.gatewayFd].sidToSession.erase(it->second.sid);
+      logicalSessions.erase(it);
     }
-    sessions.erase(client_fd);
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, nullptr);
-    close(client_fd);
+    return;
+  }
+
+  auto observer = observers.find(client_fd);
+  if (observer != observers.end()) {
+    std::vector<int> &list = observer->second.channel->observers;
+    list[observer->second.slot] = list.back();
+    observers[list.back()].slot = observer->second.slot;
+    list.pop_back();
+    observers.erase(client_fd);
+  }
+
+  auto gw = gateways.find(client_fd);
+  if (gw != gateways.end()) {
+    std::vector<int> sessions_left;
+    for (const auto &entry : gw->second.sidToSession)
+      sessions_left.push_back(entry.second);
+    for (int session_id : sessions_left)
+      disconnect_client(session_id);
+    gateways.erase(client_fd);
   }
+
+  connections.erase(client_fd);
+  webSockets.erase(client_fd);
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, nullptr);
+  close(client_fd);
 }
 
 /**
@@ -300,7 +4117,8 @@ void ChatServer::handle_client_message(int client_fd) {
  * @param password: password
  * @param client_fd: client file descriptor
  * @return: SUCCESS or FAIL
- * Check if the username and password are correct
+ * Check if the username and password are correct against the credentials
+ * loaded by reload_credentials()
  */
 int ChatServer::perform_authentication(const std::string &username,
                                        const std::string &password,
@@ -311,48 +4129,102 @@ int ChatServer::perform_authentication(const std::string &username,
     return FAIL;
   }
 
-  std::ifstream userfile(FILENAME);
-  if (!userfile.is_open()) {
-    std::cerr << "error opening " << FILENAME << std::endl;
-    return FAIL;
-  }
-
-  std::string line;
-  while (std::getline(userfile, line)) {
-    size_t colon_pos = line.find(":");
-    if (colon_pos != std::string::npos) {
-      std::string stored_username = line.substr(0, colon_pos);
-      std::string stored_password = line.substr(colon_pos + 1);
-      strip_input(stored_username);
-      strip_input(stored_password);
-
-      if (DEBUG)
-        std::cout << "Checked: " << stored_username << " " << stored_password
-                  << std::endl;
+  auto it = credentials.find(username);
+  if (DEBUG && it != credentials.end())
+    std::cout << "Checked: " << it->first << " " << it->second << std::endl;
 
-      if (stored_username == username && stored_password == password) {
-        return SUCCESS;
-      }
-    }
+  if (it != credentials.end() && it->second == password) {
+    return SUCCESS;
   }
   return FAIL;
 }
 
+/**
+ * Suppress duplicate
+ * @param client_fd: sender file descriptor
+ * @param target: "@user", "#group" or "*" for a broadcast
+ * @param msg: message body
+ * @param content_dedup: false when the command carried an idempotency key
+ * @return: true if the message repeats a recent one and must be dropped
+ * Senders who turned /dedup on have a ring of recent (target, body)
+ * fingerprints; groups with /dedup on also drop a body any member posted
+ * within the window.
+ */
+bool ChatServer::suppress_duplicate(int client_fd, const std::string &target,
+                                    const std::string &msg,
+                                    bool content_dedup) {
+  if (!content_dedup || DEDUP_WINDOW_MS == 0)
+    return false;
+
+  int64_t now = now_ms();
+  bool duplicate = false;
+  auto sender = senderDedup.find(fdTousername[client_fd]);
+  if (sender != senderDedup.end())
+    duplicate = sender->second.seen(fingerprint(msg, fingerprint(target)),
+                                    now, DEDUP_WINDOW_MS);
+
+  if (!duplicate && target[0] == '#') {
+    auto it = groupDedup.find(target.substr(1));
+    if (it != groupDedup.end())
+      duplicate = it->second.seen(fingerprint(msg), now, DEDUP_WINDOW_MS);
+  }
+
+  if (duplicate) {
+    std::string server_message = "Duplicate message suppressed\n";
+    send_server_error(client_fd, server_message);
+  }
+  return duplicate;
+}
+
 /**
  * Process authenticated message
  * @param client_fd: client file descriptor
  * @param message: message to process
+ * @param content_dedup: apply the content duplicate filter
  * Process the message from the authenticated user
  * and perform the corresponding action
  */
 void ChatServer::process_authenticated_message(int client_fd,
-                                               const std::string &message) {
+                                               const std::string &message,
+                                               bool content_dedup) {
   std::stringstream ss(message);
   std::string command;
   ss >> command;
 
+  if (command != "/pong")
+    note_reader(client_fd);
+
   std::string server_message;
-  if (command == "/msg") {
+  if (has_control_bytes(message)) {
+    server_message = "Control characters are not allowed\n";
+    send_server_error(client_fd, server_message);
+    return;
+  }
+  if (command == "/idem") {
+    std::string key;
+    ss >> key;
+    std::string rest;
+    std::getline(ss, rest);
+    strip_input(rest);
+    if (key.empty() || rest.empty()) {
+      server_message = "Usage: /idem <key> <command>\n";
+      send_server_error(client_fd, server_message);
+    } else if (idempotencyKeys[fdTousername[client_fd]].seen(
+                   fingerprint(key), now_ms())) {
+      server_message = "Request " + key + " already processed\n";
+      send_server(client_fd, server_message);
+    } else {
+      // The key identifies the request, so identical retries of distinct
+      // requests (new keys) are not treated as duplicates. A command that
+      // failed is not recorded, so it can be retried under the same key.
+      std::string username = fdTousername[client_fd];
+      uint64_t errors = errorsSent;
+      process_authenticated_message(client_fd, rest, false);
+      if (errorsSent == errors && clients.count(client_fd) > 0)
+        idempotencyKeys[username].record(fingerprint(key), now_ms(),
+                                         IDEMPOTENCY_WINDOW_MS);
+    }
+  } else if (command == "/msg") {
     std::string receiver;
     ss >> receiver;
     std::string msg;
@@ -369,17 +4241,19 @@ void ChatServer::process_authenticated_message(int client_fd,
     } else if (receiver.empty()) {
       server_message = "Please specify a username\n";
       send_server_error(client_fd, server_message);
-    } else {
-      int receiver_fd = usernameTofd[receiver];
-      std::string s_message = "[ " + fdTousername[client_fd] + " ] : " + msg;
-      send(receiver_fd, s_message.c_str(), s_message.size(), 0);
+    } else if (!suppress_duplicate(client_fd, "@" + receiver, msg,
+                                   content_dedup)) {
+      send_direct_message(client_fd, fdTousername[client_fd], receiver, msg);
     }
   } else if (command == "/broadcast") {
     std::string msg;
     std::getline(ss, msg);
     strip_input(msg);
     msg.push_back('\n');
-    broadcast_message(msg.c_str(), msg.size(), client_fd, false);
+    if (!suppress_duplicate(client_fd, "*", msg, content_dedup)) {
+      topSenders.record(fdTousername[client_fd], msg.size());
+      broadcast_message(msg.c_str(), msg.size(), client_fd, false);
+    }
   } else if (command == "/group_msg") {
     std::string group;
     ss >> group;
@@ -394,14 +4268,58 @@ void ChatServer::process_authenticated_message(int client_fd,
     } else if (group.empty()) {
       server_message = "Please specify a group name\n";
       send_server_error(client_fd, server_message);
+    } else if (!suppress_duplicate(client_fd, "#" + group, msg,
+                                   content_dedup)) {
+      send_group_message(client_fd, fdTousername[client_fd], group, msg);
+    }
+  } else if (command == "/create_channel" || command == "/add_publisher") {
+    std::string name, publisher;
+    ss >> name >> publisher;
+    const std::string &username = fdTousername[client_fd];
+    auto it = channels.find(name);
+    if (command == "/create_channel")
+      publisher = username;
+    if (name.empty() || publisher.empty()) {
+      server_message = command == "/create_channel"
+                           ? "Please specify a channel name\n"
+                           : "Usage: /add_publisher <channel> <username>\n";
+      send_server_error(client_fd, server_message);
+    } else if (command == "/create_channel" && it != channels.end()) {
+      server_message = "Channel already exists\n";
+      send_server_error(client_fd, server_message);
+    } else if (command == "/add_publisher" &&
+               (it == channels.end() ||
+                it->second.publishers.count(username) == 0)) {
+      server_message = "You do not publish to this channel\n";
+      send_server_error(client_fd, server_message);
+    } else if (credentials.count(publisher) == 0) {
+      server_message = "User not found\n";
+      send_server_error(client_fd, server_message);
     } else {
-      for (int receiver_fd : groupTofd[group]) {
-        if (receiver_fd == client_fd)
-          continue;
-        std::string s_message =
-            LIGHT_CYAN + "[ Group " + group + " ]" + RESET + " : " + msg;
-        send(receiver_fd, s_message.c_str(), s_message.size(), 0);
-      }
+      uint64_t seq = journal.append(RecordKind::CHANNEL, name, publisher);
+      apply_record(
+          JournalRecord{seq, 0, RecordKind::CHANNEL, name, publisher, 0, 0});
+      server_message = command == "/create_channel"
+                           ? "Channel " + name + " created\n"
+                           : publisher + " can publish to " + name + "\n";
+      send_server(client_fd, server_message);
+    }
+  } else if (command == "/channel_msg") {
+    std::string name;
+    ss >> name;
+    std::string msg;
+    std::getline(ss, msg);
+    strip_input(msg);
+    msg.push_back('\n');
+    auto it = channels.find(name);
+    if (it == channels.end()) {
+      server_message = "Channel not found\n";
+      send_server_error(client_fd, server_message);
+    } else if (it->second.publishers.count(fdTousername[client_fd]) == 0) {
+      server_message = "Channel " + name + " is read-only\n";
+      send_server_error(client_fd, server_message);
+    } else {
+      send_channel_message(client_fd, name, msg);
     }
   } else if (command == "/create_group") {
     std::string group;
@@ -413,10 +4331,16 @@ void ChatServer::process_authenticated_message(int client_fd,
     } else if (group.empty()) {
       server_message = "Please specify a group name\n";
       send_server_error(client_fd, server_message);
+    } else if (!valid_group_name(group)) {
+      server_message = "Group names may not contain '*' or '!'\n";
+      send_server_error(client_fd, server_message);
     } else {
-      groupTofd[group] = {client_fd};
+      uint64_t seq = journal.append(RecordKind::GROUP_CREATE, group,
+                                    fdTousername[client_fd]);
+      apply_record(JournalRecord{seq, 0, RecordKind::GROUP_CREATE, group,
+                                 fdTousername[client_fd], 0, 0});
       std::string create_msg = "Group " + group + " created\n";
-      send(client_fd, create_msg.c_str(), create_msg.size(), 0);
+      send_to(client_fd, create_msg);
     }
   } else if (command == "/join_group") {
     std::string group;
@@ -433,10 +4357,17 @@ void ChatServer::process_authenticated_message(int client_fd,
         server_message = "Already a member\n";
         send_server(client_fd, server_message);
       } else {
-        groupTofd[group].insert(client_fd);
+        uint64_t seq = journal.append(RecordKind::GROUP_JOIN, group,
+                                      fdTousername[client_fd]);
+        apply_record(JournalRecord{seq, 0, RecordKind::GROUP_JOIN, group,
+                                   fdTousername[client_fd], 0, 0});
+        // Nothing sent before joining is owed to a pull-mode reader.
+        auto delivery = groupDelivery.find(group);
+        if (delivery != groupDelivery.end() && delivery->second.pullSince > 0)
+          readCursors[group][fdTousername[client_fd]] = seq;
         std::string join_msg =
             GREEN + "You joined the group " + group + ".\n" + RESET;
-        send(client_fd, join_msg.c_str(), join_msg.size(), 0);
+        send_to(client_fd, join_msg);
       }
     }
   } else if (command == "/leave_group") {
@@ -445,7 +4376,7 @@ void ChatServer::process_authenticated_message(int client_fd,
     if (group.empty()) {
       std::string error_msg =
           RED + "Error: Please specify a group to leave. " + RESET;
-      send(client_fd, error_msg.c_str(), error_msg.size(), 0);
+      send_to(client_fd, error_msg);
       return;
     }
     strip_input(group);
@@ -454,31 +4385,994 @@ void ChatServer::process_authenticated_message(int client_fd,
       send_server_error(client_fd, server_message);
     } else {
       if (groupTofd[group].find(client_fd) != groupTofd[group].end()) {
-        groupTofd[group].erase(client_fd);
+        uint64_t seq = journal.append(RecordKind::GROUP_LEAVE, group,
+                                      fdTousername[client_fd]);
+        apply_record(JournalRecord{seq, 0, RecordKind::GROUP_LEAVE, group,
+                                   fdTousername[client_fd], 0, 0});
+        auto digest = digests.find(client_fd);
+        if (digest != digests.end() && digest->second.count(group) > 0) {
+          flush_digest(client_fd, group);
+          digest->second.erase(group);
+          if (digest->second.empty())
+            digests.erase(digest);
+        }
         std::string leave_msg =
             GREEN + "You left the group " + group + ".\n" + RESET;
-        send(client_fd, leave_msg.c_str(), leave_msg.size(), 0);
+        send_to(client_fd, leave_msg);
       } else {
         server_message = "Not a member of the group\n";
         send_server_error(client_fd, server_message);
       }
     }
+  } else if (command == "/digest") {
+    std::string group, interval, count;
+    ss >> group >> interval >> count;
+    auto number = [](const std::string &value) {
+      return !value.empty() && value.size() < 9 &&
+             value.find_first_not_of("0123456789") == std::string::npos &&
+             std::stoll(value) > 0;
+    };
+    if (group.empty() ||
+        (interval != "off" &&
+         (!number(interval) || std::stoll(interval) > DIGEST_MAX_SECONDS ||
+          (!count.empty() &&
+           (!number(count) || std::stoull(count) > DIGEST_MAX_MESSAGES))))) {
+      server_message = "Usage: /digest <groupname> <seconds> [<messages>]|off\n";
+      send_server_error(client_fd, server_message);
+    } else if (groupTofd.find(group) == groupTofd.end()) {
+      server_message = "Group not found\n";
+      send_server_error(client_fd, server_message);
+    } else if (groupTofd[group].count(client_fd) == 0) {
+      server_message = "Not a member of the group\n";
+      send_server_error(client_fd, server_message);
+    } else if (interval == "off") {
+      if (wants_digest(client_fd, group)) {
+        flush_digest(client_fd, group);
+        digests[client_fd].erase(group);
+        if (digests[client_fd].empty())
+          digests.erase(client_fd);
+      }
+      server_message = "Digest disabled for " + group + "\n";
+      send_server(client_fd, server_message);
+    } else {
+      DigestSubscription &digest = digests[client_fd][group];
+      digest.intervalMs = std::stoll(interval) * 1000;
+      digest.maxMessages =
+          count.empty() ? DIGEST_MESSAGES : std::stoull(count);
+      server_message = "Digest of " + group + " every " + interval +
+                       "s or " + std::to_string(digest.maxMessages) +
+                       " messages\n";
+      send_server(client_fd, server_message);
+    }
+  } else if (command == "/who" || command == "/list_groups") {
+    std::string args;
+    std::getline(ss, args);
+    if (command == "/who")
+      send_listing(client_fd, command, onlineListing, "Online users", args);
+    else
+      send_listing(client_fd, command, groupListing, "Groups", args);
+  } else if (command == "/mute" || command == "/block" ||
+             command == "/unmute" || command == "/unblock") {
+    std::string target;
+    ss >> target;
+    const std::string &username = fdTousername[client_fd];
+    auto list = muteLists.find(username);
+    if (target.empty() && command == "/mute") {
+      std::string muted, blocked;
+      if (list != muteLists.end()) {
+        for (const std::string &name : list->second.names(false))
+          muted += " " + name;
+        for (const std::string &name : list->second.names(true))
+          blocked += " " + name;
+      }
+      server_message = "Muted:" + (muted.empty() ? " none" : muted) +
+                       "\nBlocked:" + (blocked.empty() ? " none" : blocked) +
+                       "\n";
+      send_server(client_fd, server_message);
+    } else if (target.empty()) {
+      server_message = "Usage: " + command + " <username>\n";
+      send_server_error(client_fd, server_message);
+    } else if (credentials.count(target) == 0 || target == username) {
+      server_message = "User not found\n";
+      send_server_error(client_fd, server_message);
+    } else {
+      bool unmute = command == "/unmute" || command == "/unblock";
+      bool block = command == "/block" ||
+                   (command == "/mute" && list != muteLists.end() &&
+                    list->second.blocks(user_hash(target)));
+      std::string action = unmute ? "unmute" : (block ? "block" : "mute");
+      uint64_t seq = journal.append(RecordKind::MUTE, username,
+                                    action + " " + target);
+      apply_record(JournalRecord{seq, 0, RecordKind::MUTE, username,
+                                 action + " " + target, 0, 0});
+      server_message =
+          target + (unmute ? " unmuted" : (block ? " blocked" : " muted")) +
+          "\n";
+      send_server(client_fd, server_message);
+    }
+  } else if (command == "/schedule") {
+    std::string args;
+    std::getline(ss, args);
+    strip_input(args);
+    if (!args.empty()) {
+      schedule_message(client_fd, args);
+    } else {
+      const std::string &username = fdTousername[client_fd];
+      std::vector<std::pair<int64_t, uint64_t>> mine;
+      for (const auto &entry : scheduled) {
+        if (entry.second.sender == username)
+          mine.emplace_back(entry.second.dueMs, entry.first);
+      }
+      std::sort(mine.begin(), mine.end());
+      server_message = std::to_string(mine.size()) + " scheduled messages\n";
+      for (const auto &entry : mine) {
+        const ScheduledMessage &message = scheduled[entry.second];
+        time_t t = message.dueMs / 1000;
+        struct tm local;
+        char stamp[32];
+        localtime_r(&t, &local);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+        server_message += std::to_string(entry.second) + "  " + stamp + "  " +
+                          message.target + "  " + message.text;
+      }
+      send_server(client_fd, server_message);
+    }
+  } else if (command == "/unschedule") {
+    std::string id;
+    ss >> id;
+    auto it = scheduled.end();
+    if (!id.empty() && id.size() < 20 &&
+        id.find_first_not_of("0123456789") == std::string::npos)
+      it = scheduled.find(std::stoull(id));
+    if (it == scheduled.end() || it->second.sender != fdTousername[client_fd]) {
+      server_message = "No such scheduled message\n";
+      send_server_error(client_fd, server_message);
+    } else {
+      uint64_t seq = journal.append(RecordKind::SCHEDULE_DONE, "", id);
+      apply_record(
+          JournalRecord{seq, 0, RecordKind::SCHEDULE_DONE, "", id, 0, 0});
+      server_message = "Scheduled message " + id + " cancelled\n";
+      send_server(client_fd, server_message);
+    }
+  } else if (command == "/typing") {
+    std::string target;
+    ss >> target;
+    const std::string &username = fdTousername[client_fd];
+    if (!target.empty() && target[0] == '#') {
+      std::string group = target.substr(1);
+      auto it = groupTofd.find(group);
+      if (it == groupTofd.end() ||
+          it->second.find(client_fd) == it->second.end()) {
+        server_message = "Not a member of the group\n";
+        send_server_error(client_fd, server_message);
+        return;
+      }
+      std::string text = username + " is typing in " + group + "\n";
+      uint64_t sender = user_hash(username);
+      for (int receiver_fd : it->second) {
+        if (receiver_fd != client_fd && !is_muted(receiver_fd, sender, false))
+          queue_ephemeral(receiver_fd, "typing " + username + " " + target,
+                          text);
+      }
+    } else if (usernameTofd.find(target) != usernameTofd.end() &&
+               usernameTofd[target] != client_fd) {
+      if (!is_muted(usernameTofd[target], user_hash(username), false))
+        queue_ephemeral(usernameTofd[target], "typing " + username,
+                        username + " is typing\n");
+    } else {
+      server_message = "Usage: /typing <username|#groupname>\n";
+      send_server_error(client_fd, server_message);
+    }
+  } else if (command == "/status") {
+    std::string status;
+    std::getline(ss, status);
+    strip_input(status);
+    if (status.size() > STATUS_MAX) {
+      server_message = "Status too long (limit " +
+                       std::to_string(STATUS_MAX) + " bytes)\n";
+      send_server_error(client_fd, server_message);
+      return;
+    }
+    const std::string &username = fdTousername[client_fd];
+    std::string text = username + " is now: " + status + "\n";
+    // Only people the user talks to see it: members of the user's groups
+    // and online direct message partners, minus those who muted the user.
+    std::unordered_set<int> recipients;
+    for (const std::string &group : fdTogroups[client_fd]) {
+      auto members = groupTofd.find(group);
+      if (members != groupTofd.end())
+        recipients.insert(members->second.begin(), members->second.end());
+    }
+    for (const std::string &dm : userDMs[username]) {
+      size_t bar = dm.find('|');
+      std::string a = dm.substr(2, bar - 2), b = dm.substr(bar + 1);
+      auto partner = usernameTofd.find(a == username ? b : a);
+      if (partner != usernameTofd.end())
+        recipients.insert(partner->second);
+    }
+    recipients.erase(client_fd);
+    uint64_t sender = user_hash(username);
+    for (int receiver_fd : recipients) {
+      if (!is_muted(receiver_fd, sender, false))
+        queue_ephemeral(receiver_fd, "status " + username, text);
+    }
+  } else if (command == "/credit") {
+    std::string amount;
+    ss >> amount;
+    if (amount == "off") {
+      auto it = flowControl.find(client_fd);
+      if (it != flowControl.end()) {
+        grant_credit(client_fd, it->second.held.size());
+        flowControl.erase(client_fd);
+      }
+    } else if (!amount.empty() &&
+               amount.find_first_not_of("0123456789") == std::string::npos &&
+               amount.size() < 10) {
+      grant_credit(client_fd, std::stoull(amount));
+    } else {
+      server_message = "Usage: /credit <n>|off\n";
+      send_server_error(client_fd, server_message);
+    }
+  } else if (command == "/group_qos") {
+    std::string group, level;
+    ss >> group >> level;
+    if (groupTofd.find(group) == groupTofd.end()) {
+      server_message = "Group not found\n";
+      send_server_error(client_fd, server_message);
+    } else if (groupTofd[group].find(client_fd) == groupTofd[group].end()) {
+      server_message = "Not a member of the group\n";
+      send_server_error(client_fd, server_message);
+    } else if (level == "realtime" || level == "normal" || level == "bulk") {
+      if (level == "normal")
+        groupQos.erase(group);
+      else
+        groupQos[group] =
+            level == "realtime" ? QosClass::REALTIME : QosClass::BULK;
+      server_message = "Group " + group + " is now " + level + "\n";
+      send_server(client_fd, server_message);
+    } else {
+      server_message = "Usage: /group_qos <groupname> realtime|normal|bulk\n";
+      send_server_error(client_fd, server_message);
+    }
+  } else if (command == "/dedup") {
+    std::string group, mode;
+    ss >> group >> mode;
+    if (mode.empty() && (group == "on" || group == "off")) {
+      const std::string &username = fdTousername[client_fd];
+      if (group == "on")
+        senderDedup[username];
+      else
+        senderDedup.erase(username);
+      server_message = "Duplicate filter " +
+                       std::string(group == "on" ? "enabled" : "disabled") +
+                       " for your messages\n";
+      send_server(client_fd, server_message);
+    } else if (groupTofd.find(group) == groupTofd.end()) {
+      server_message = "Group not found\n";
+      send_server_error(client_fd, server_message);
+    } else if (groupTofd[group].find(client_fd) == groupTofd[group].end()) {
+      server_message = "Not a member of the group\n";
+      send_server_error(client_fd, server_message);
+    } else if (mode == "on") {
+      groupDedup[group];
+      server_message = "Duplicate filter enabled for " + group + "\n";
+      send_server(client_fd, server_message);
+    } else if (mode == "off") {
+      groupDedup.erase(group);
+      server_message = "Duplicate filter disabled for " + group + "\n";
+      send_server(client_fd, server_message);
+    } else {
+      server_message = "Usage: /dedup [<groupname>] on|off\n";
+      send_server_error(client_fd, server_message);
+    }
+  } else if (command == "/sync") {
+    std::string since;
+    ss >> since;
+    if (since.empty() ||
+        since.find_first_not_of("0123456789") != std::string::npos ||
+        since.size() > 19) {
+      server_message = "Usage: /sync <last sequence number>\n";
+      send_server_error(client_fd, server_message);
+    } else {
+      syncClients.insert(client_fd);
+      replay_since(client_fd, std::stoull(since));
+    }
+  } else if (command == "/heartbeat" && client_fd < 0) {
+    server_message = "Heartbeats are handled by the gateway connection\n";
+    send_server_error(client_fd, server_message);
+  } else if (command == "/heartbeat") {
+    Connection &conn = connections[client_fd];
+    if (!conn.heartbeat) {
+      conn.heartbeat = true;
+      schedule_heartbeat(client_fd, HEARTBEAT_INTERVAL_MS);
+    }
+    server_message = "Heartbeat enabled\n";
+    send_server(client_fd, server_message);
+  } else if (command == "/retention") {
+    std::string group, age, bytes;
+    ss >> group >> age >> bytes;
+    auto number = [](const std::string &value) {
+      return !value.empty() && value.size() < 16 &&
+             value.find_first_not_of("0123456789") == std::string::npos;
+    };
+    if (group.empty() || (!age.empty() && (!number(age) || !number(bytes)))) {
+      server_message =
+          "Usage: /retention <groupname> [<max age seconds> <max bytes>]\n";
+      send_server_error(client_fd, server_message);
+    } else if (groupTofd.find(group) == groupTofd.end()) {
+      server_message = "Group not found\n";
+      send_server_error(client_fd, server_message);
+    } else if (userGroups[fdTousername[client_fd]].count(group) == 0) {
+      server_message = "Not a member of the group\n";
+      send_server_error(client_fd, server_message);
+    } else if (!age.empty() &&
+               (groupCreators.count(group) == 0 ||
+                groupCreators[group] != fdTousername[client_fd])) {
+      // Retention deletes history for everyone, so it is not up to any member.
+      server_message =
+          "Only the group's creator or an admin can change its retention\n";
+      send_server_error(client_fd, server_message);
+    } else if (!age.empty()) {
+      set_retention(group, std::stoull(age), std::stoull(bytes),
+                    fdTousername[client_fd]);
+    } else {
+      server_message = describe_retention(group);
+      send_server(client_fd, server_message);
+    }
+  } else if (command == "/history") {
+    std::string target, word;
+    ss >> target;
+    uint64_t before = UINT64_MAX;
+    size_t limit = HISTORY_DEFAULT;
+    bool valid = !target.empty();
+    while (valid && ss >> word) {
+      std::string value;
+      ss >> value;
+      valid = !value.empty() && value.size() < 19 &&
+              value.find_first_not_of("0123456789") == std::string::npos;
+      if (valid && word == "before")
+        before = std::stoull(value);
+      else if (valid && word == "limit")
+        limit = std::min<size_t>(std::max<size_t>(std::stoull(value), 1),
+                                 HISTORY_MAX);
+      else
+        valid = false;
+    }
+    const std::string &username = fdTousername[client_fd];
+    if (!valid) {
+      server_message =
+          "Usage: /history <group|user> [before <seq>] [limit <n>]\n";
+      send_server_error(client_fd, server_message);
+    } else if (userGroups[username].count(target) > 0) {
+      send_history(client_fd, target, "g:" + target,
+                   memberSince[target][username], before, limit);
+    } else if (groupTofd.find(target) != groupTofd.end()) {
+      server_message = "Not a member of the group\n";
+      send_server_error(client_fd, server_message);
+    } else if (credentials.count(target) > 0 && target != username) {
+      send_history(client_fd, target, dm_key(username, target), 0, before,
+                   limit);
+    } else {
+      server_message = "No such group or user\n";
+      send_server_error(client_fd, server_message);
+    }
+  } else if (command == "/ping") {
+    std::string token;
+    ss >> token;
+    if (token.empty() || token.size() > 64) {
+      server_message = "Usage: /ping <token>\n";
+      send_server_error(client_fd, server_message);
+    } else {
+      // Plain line so clients can parse it; sent on the control lane.
+      std::string pong = "PONG " + token + " " + std::to_string(receivedAtUs) +
+                         " " + std::to_string(unix_us()) + "\n";
+      send_to(client_fd, pong);
+    }
+  } else if (command == "/pong") {
+    // Liveness was already recorded when the data arrived.
   } else if (command == "CLOSE") {
     std::cout << "Connection closed on socket " << client_fd << std::endl;
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, nullptr);
-    activeUsernames.erase(fdTousername[client_fd]);
-    usernameTofd.erase(fdTousername[client_fd]);
-    clients.erase(client_fd);
-    broadcast_message(
-        (fdTousername[client_fd] + " has left the chat\n").c_str(),
-        fdTousername[client_fd].size() + 20, client_fd, true);
-    fdTousername.erase(client_fd);
-    close(client_fd);
+    disconnect_client(client_fd);
   } else {
     send_server(client_fd, help_message);
   }
 }
 
+/**
+ * Recover state
+ * Replay the journal: rebuilds groups, memberships and the in-memory
+ * history before any client can connect.
+ */
+void ChatServer::recover_state() {
+  size_t records = 0;
+  int64_t started = now_ms();
+  journal.open([this, &records](const JournalRecord &record) {
+    apply_record(record);
+    ++records;
+  });
+  scheduleWheel.start(unix_ms());
+  for (const auto &entry : scheduled)
+    scheduleWheel.add(entry.first, entry.second.dueMs);
+  std::cout << "Recovered " << records << " journal records, last sequence "
+            << journal.last_seq() << ", in " << now_ms() - started << " ms"
+            << std::endl;
+}
+
+/**
+ * Set a group's retention policy
+ * @param group: group name
+ * @param age_sec: maximum message age, 0 = no limit
+ * @param bytes: maximum history size, 0 = no limit
+ * @param setter: username, or "admin" from the admin socket
+ * Journals the policy with its setter and tells every online member,
+ * since the next compaction deletes what falls outside it.
+ */
+void ChatServer::set_retention(const std::string &group, uint64_t age_sec,
+                               uint64_t bytes, const std::string &setter) {
+  std::string policy =
+      std::to_string(age_sec) + " " + std::to_string(bytes) + " " + setter;
+  uint64_t seq = journal.append(RecordKind::RETENTION, group, policy);
+  apply_record(
+      JournalRecord{seq, 0, RecordKind::RETENTION, group, policy, 0, 0});
+
+  std::string notice = describe_retention(group);
+  std::vector<int> members(groupTofd[group].begin(), groupTofd[group].end());
+  deliver_many(members, GREEN + notice + RESET);
+}
+
+/**
+ * Describe a group's retention policy
+ * @param group: group name
+ */
+std::string ChatServer::describe_retention(const std::string &group) {
+  auto it = groupRetention.find(group);
+  if (it == groupRetention.end())
+    return "Group " + group + " keeps all messages\n";
+  const RetentionPolicy &policy = it->second;
+  return "Group " + group + " keeps messages for " +
+         (policy.maxAgeMs > 0 ? std::to_string(policy.maxAgeMs / 1000) + "s"
+                              : "ever") +
+         ", up to " +
+         (policy.maxBytes > 0 ? std::to_string(policy.maxBytes) + " bytes"
+                              : "any size") +
+         (policy.setBy.empty() ? "" : " (set by " + policy.setBy + ")") +
+         "\n";
+}
+
+/**
+ * Apply a journal record to the in-memory state
+ * @param record: record read back at startup or just appended
+ */
+void ChatServer::apply_record(const JournalRecord &record) {
+  switch (record.kind) {
+  case RecordKind::GROUP_CREATE:
+    groupTofd[record.key];
+    groupCreators.emplace(record.key, record.text);
+    groupListing.insert(record.key);
+    add_membership(record.key, record.text, record.seq);
+    break;
+  case RecordKind::GROUP_JOIN:
+    add_membership(record.key, record.text, record.seq);
+    break;
+  case RecordKind::CHANNEL:
+    channels[record.key].publishers.insert(record.text);
+    break;
+  case RecordKind::GROUP_IMPORT: {
+    groupTofd[record.key];
+    groupListing.insert(record.key);
+    std::stringstream ss(record.text);
+    std::string member;
+    while (ss >> member)
+      add_membership(record.key, member, record.seq);
+    break;
+  }
+  case RecordKind::GROUP_LEAVE:
+    remove_membership(record.key, record.text);
+    break;
+  case RecordKind::RETENTION: {
+    std::stringstream ss(record.text);
+    RetentionPolicy policy;
+    int64_t age_sec = 0;
+    ss >> age_sec >> policy.maxBytes >> policy.setBy;
+    policy.maxAgeMs = age_sec * 1000;
+    if (policy.maxAgeMs > 0 || policy.maxBytes > 0)
+      groupRetention[record.key] = policy;
+    else
+      groupRetention.erase(record.key);
+    break;
+  }
+  case RecordKind::MUTE: {
+    std::stringstream ss(record.text);
+    std::string action, target;
+    ss >> action >> target;
+    MuteList &list = muteLists[record.key];
+    if (action == "unmute")
+      list.remove(user_hash(target));
+    else
+      list.add(user_hash(target), target, action == "block");
+    if (list.empty())
+      muteLists.erase(record.key);
+    refresh_muter(record.key);
+    break;
+  }
+  case RecordKind::SCHEDULE: {
+    // "<due ms> <target> <message>"
+    size_t first = record.text.find(' ');
+    size_t second = record.text.find(' ', first + 1);
+    if (second == std::string::npos)
+      break;
+    scheduled[record.seq] = ScheduledMessage{
+        std::stoll(record.text.substr(0, first)), record.key,
+        record.text.substr(first + 1, second - first - 1),
+        record.text.substr(second + 1)};
+    break;
+  }
+  case RecordKind::SCHEDULE_DONE: {
+    std::stringstream ss(record.text);
+    uint64_t id;
+    while (ss >> id)
+      scheduled.erase(id);
+    break;
+  }
+  case RecordKind::MESSAGE: {
+    std::deque<HotEntry> &hot = hotHistory[record.key];
+    hot.push_back(HotEntry{record.seq, record.time, record.sender,
+                           std::make_shared<const std::string>(record.text)});
+    if (hot.size() > HOT_PER_CONVERSATION)
+      hot.pop_front();
+    ConversationIndex &index = historyIndex[record.key];
+    if (index.count++ % HISTORY_INDEX_STRIDE == 0)
+      index.sparse.push_back(IndexEntry{
+          record.seq, RecordLocation{record.segment, record.offset},
+          index.bytes});
+    index.bytes += record.text.size();
+    index.lastSeq = record.seq;
+    if (record.key.compare(0, 2, "d:") == 0) {
+      size_t bar = record.key.find('|');
+      userDMs[record.key.substr(2, bar - 2)].insert(record.key);
+      userDMs[record.key.substr(bar + 1)].insert(record.key);
+    }
+    break;
+  }
+  }
+}
+
+/**
+ * Add membership
+ * @param group: group name
+ * @param username: member
+ * @param seq: sequence number of the join; /sync and /history only show
+ *             the member later messages
+ * Also attaches the member's connection if it is online.
+ */
+void ChatServer::add_membership(const std::string &group,
+                                const std::string &username, uint64_t seq) {
+  groupMembers[group].insert(username);
+  memberSince[group].emplace(username, seq);
+  userGroups[username].insert(group);
+  auto it = usernameTofd.find(username);
+  if (it != usernameTofd.end()) {
+    groupTofd[group].insert(it->second);
+    fdTogroups[it->second].insert(group);
+    auto delivery = groupDelivery.find(group);
+    if (delivery != groupDelivery.end() && delivery->second.pull &&
+        is_reading(it->second, now_ms()))
+      groupReaders[group].insert(it->second);
+  }
+}
+
+/**
+ * Remove membership
+ * @param group: group name
+ * @param username: member
+ */
+void ChatServer::remove_membership(const std::string &group,
+                                   const std::string &username) {
+  groupMembers[group].erase(username);
+  memberSince[group].erase(username);
+  userGroups[username].erase(group);
+  auto it = usernameTofd.find(username);
+  if (it != usernameTofd.end()) {
+    groupTofd[group].erase(it->second);
+    fdTogroups[it->second].erase(group);
+  }
+}
+
+/**
+ * Journal a chat message
+ * @param key: conversation key
+ * @param text: rendered message
+ * @param sender: sender's user_hash(), journaled with the message so
+ *                catch-up can honour mute lists, also after a restart
+ * @return: the message's sequence number
+ */
+uint64_t ChatServer::journal_message(const std::string &key,
+                                     const std::string &text,
+                                     uint64_t sender) {
+  uint64_t seq = journal.append(RecordKind::MESSAGE, key, text, sender);
+  RecordLocation at = journal.last_location();
+  apply_record(JournalRecord{seq, unix_ms(), RecordKind::MESSAGE, key, text,
+                             at.segment, at.offset, sender});
+  return seq;
+}
+
+/**
+ * Replay messages since a sequence number
+ * @param client_fd: client that sent /sync
+ * @param since: last sequence number the client has cached
+ * Sends the client's newer messages (broadcasts, its groups and its direct
+ * messages) as tagged records, oldest first and at most SYNC_LIMIT, then
+ * "SYNCED <seq>", or "SYNCED <seq> more" if the client should ask again.
+ * Only the in-memory tail of each conversation is replayed.
+ */
+void ChatServer::replay_since(int client_fd, uint64_t since) {
+  const std::string &username = fdTousername[client_fd];
+  // Conversation keys with the sequence number to replay after: a group's
+  // messages from before the member joined are not replayed.
+  std::vector<std::pair<std::string, uint64_t>> keys = {{"b", since}};
+  for (const std::string &group : userGroups[username])
+    keys.emplace_back("g:" + group,
+                      std::max(since, memberSince[group][username]));
+  for (const std::string &dm : userDMs[username])
+    keys.emplace_back(dm, since);
+
+  std::vector<std::pair<const std::string *, const HotEntry *>> pending;
+  for (const auto &key : keys) {
+    auto it = hotHistory.find(key.first);
+    if (it == hotHistory.end())
+      continue;
+    const std::deque<HotEntry> &hot = it->second;
+    auto first = std::upper_bound(
+        hot.begin(), hot.end(), key.second,
+        [](uint64_t seq, const HotEntry &entry) { return seq < entry.seq; });
+    for (; first != hot.end(); ++first)
+      pending.emplace_back(&it->first, &*first);
+  }
+  std::sort(pending.begin(), pending.end(),
+            [](const std::pair<const std::string *, const HotEntry *> &a,
+               const std::pair<const std::string *, const HotEntry *> &b) {
+              return a.second->seq < b.second->seq;
+            });
+
+  bool more = pending.size() > SYNC_LIMIT;
+  if (more)
+    pending.resize(SYNC_LIMIT);
+  std::string batch;
+  for (const auto &entry : pending)
+    batch += tag_record(entry.second->seq, *entry.first, *entry.second->text);
+  uint64_t upto = more ? pending.back().second->seq : journal.last_seq();
+  batch += "SYNCED " + std::to_string(upto) + (more ? " more" : "") + "\n";
+  send_to(client_fd, batch, Lane::BULK);
+}
+
+/**
+ * Send a page of history
+ * @param client_fd: requesting client
+ * @param target: group or user name, as typed
+ * @param key: conversation key
+ * @param after: only messages with a larger sequence number (a group
+ *               member's join)
+ * @param before: only messages with a smaller sequence number
+ * @param limit: page size
+ * Reads span the storage tiers. A page inside the in-memory tail (hot) is
+ * served from memory. Otherwise the sparse index gives a journal location
+ * at most limit + HISTORY_INDEX_STRIDE messages before the page, and the
+ * journal is walked from there: plain TCP clients get messages in
+ * uncompressed segments (warm) as sendfile() ranges, so the text is never
+ * copied into the server; messages in archives (cold) are copied out of
+ * the decompressed block. Other clients always get copies (tagged for
+ * /sync clients, framed for WebSocket and gateway sessions). Messages past
+ * the group's retention policy are skipped even before compaction drops
+ * them.
+ */
+void ChatServer::send_history(int client_fd, const std::string &target,
+                              const std::string &key, uint64_t after,
+                              uint64_t before, size_t limit) {
+  struct Found {
+    uint64_t seq;
+    RecordLocation text;
+    size_t length;
+    std::shared_ptr<const std::string> copy; // hot or cold message
+  };
+  std::deque<Found> page;
+  RetentionCutoff cutoff = retention_cutoff(key);
+  // Messages from before the join are treated like expired ones.
+  cutoff.minSeq = std::max(cutoff.minSeq, after + 1);
+  auto expired = [&cutoff](uint64_t seq, int64_t time) {
+    return seq < cutoff.minSeq || time < cutoff.minTime;
+  };
+
+  auto index = historyIndex.find(key);
+  auto hot = hotHistory.find(key);
+  if (hot != hotHistory.end() && !hot->second.empty()) {
+    for (const HotEntry &entry : hot->second) {
+      if (entry.seq >= before)
+        break;
+      if (expired(entry.seq, entry.time))
+        continue;
+      page.push_back(Found{entry.seq, RecordLocation{0, 0}, 0, entry.text});
+      if (page.size() > limit)
+        page.pop_front();
+    }
+    // The tail covers the page unless older, unexpired messages exist.
+    bool complete = (index != historyIndex.end() &&
+                     index->second.count <= HOT_PER_CONVERSATION) ||
+                    cutoff.minSeq >= hot->second.front().seq;
+    if (page.size() < limit && !complete)
+      page.clear();
+  }
+
+  if (page.empty() && index != historyIndex.end() &&
+      !index->second.sparse.empty()) {
+    const std::vector<IndexEntry> &sparse = index->second.sparse;
+    auto first = std::lower_bound(
+        sparse.begin(), sparse.end(), before,
+        [](const IndexEntry &entry, uint64_t seq) { return entry.seq < seq; });
+    size_t last = first - sparse.begin();
+    size_t back = (limit + HISTORY_INDEX_STRIDE - 1) / HISTORY_INDEX_STRIDE + 1;
+    if (last > 0) {
+      const IndexEntry &start = sparse[last > back ? last - back : 0];
+      // Stop after the conversation's newest message rather than walking
+      // (and mapping) every later segment of the journal.
+      uint64_t stop = std::min(before, index->second.lastSeq + 1);
+      journal.scan(start.at, [&](const RecordHeader &header, const char *data,
+                                 RecordLocation at) {
+        if (header.seq >= stop)
+          return false;
+        if (header.kind == static_cast<uint8_t>(RecordKind::MESSAGE) &&
+            header.keyLen == key.size() &&
+            memcmp(data, key.data(), key.size()) == 0 &&
+            !expired(header.seq, header.time)) {
+          size_t skip = record_text_offset(header) - sizeof(header);
+          size_t length = header.length - record_text_offset(header);
+          page.push_back(Found{
+              header.seq,
+              RecordLocation{at.segment, at.offset + sizeof(header) + skip},
+              length,
+              journal.archived(at.segment)
+                  ? std::make_shared<const std::string>(data + skip, length)
+                  : nullptr});
+          if (page.size() > limit)
+            page.pop_front();
+        }
+        return header.seq + 1 < stop;
+      });
+    }
+  }
+
+  std::string head = "History of " + target + ": " +
+                     std::to_string(page.size()) + " messages\n";
+  send_to(client_fd, head, Lane::BULK);
+
+  bool plain = client_fd >= 0 && webSockets.count(client_fd) == 0 &&
+               syncClients.count(client_fd) == 0;
+  for (const Found &found : page) {
+    std::string text;
+    if (found.copy) {
+      text = *found.copy;
+    } else {
+      std::shared_ptr<SegmentFile> file =
+          journal.segment_file(found.text.segment);
+      if (!file)
+        continue;
+      if (plain) {
+        OutItem item;
+        item.file = file;
+        item.offset = found.text.offset;
+        item.length = found.length;
+        queue_output(client_fd, std::move(item), Lane::BULK);
+        continue;
+      }
+      text.resize(found.length);
+      if (pread(file->fd, &text[0], found.length, found.text.offset) !=
+          static_cast<ssize_t>(found.length))
+        continue;
+    }
+    send_to(client_fd,
+            syncClients.count(client_fd) > 0 ? tag_record(found.seq, key, text)
+                                             : text,
+            Lane::BULK);
+  }
+
+  std::string tail =
+      page.size() == limit
+          ? "Older: /history " + target + " before " +
+                std::to_string(page.front().seq) + "\n"
+          : "End of history\n";
+  send_to(client_fd, tail, Lane::BULK);
+}
+
+/**
+ * Schedule journal sync
+ * Flush the journal to disk every JOURNAL_SYNC_MS instead of on every
+ * append, so a crash loses at most that much history.
+ */
+void ChatServer::schedule_journal_sync() {
+  timers.schedule(JOURNAL_SYNC_MS, [this]() {
+    journal.sync();
+    schedule_journal_sync();
+  });
+}
+
+/**
+ * Retention cutoff of a conversation
+ * @param key: conversation key
+ * Only groups have retention policies. The size limit is applied at
+ * sparse index granularity: messages are kept from the newest index entry
+ * that leaves at least the limit, so up to HISTORY_INDEX_STRIDE messages
+ * more than the limit survive.
+ */
+RetentionCutoff ChatServer::retention_cutoff(const std::string &key) {
+  RetentionCutoff cutoff;
+  if (key.compare(0, 2, "g:") != 0)
+    return cutoff;
+  auto policy = groupRetention.find(key.substr(2));
+  if (policy == groupRetention.end())
+    return cutoff;
+  if (policy->second.maxAgeMs > 0)
+    cutoff.minTime = unix_ms() - policy->second.maxAgeMs;
+  auto index = historyIndex.find(key);
+  if (policy->second.maxBytes > 0 && index != historyIndex.end() &&
+      index->second.bytes > policy->second.maxBytes) {
+    uint64_t excess = index->second.bytes - policy->second.maxBytes;
+    const std::vector<IndexEntry> &sparse = index->second.sparse;
+    auto keep = std::upper_bound(
+        sparse.begin(), sparse.end(), excess,
+        [](uint64_t bytes, const IndexEntry &entry) {
+          return bytes < entry.bytesBefore;
+        });
+    if (keep != sparse.begin())
+      cutoff.minSeq = std::prev(keep)->seq;
+  }
+  return cutoff;
+}
+
+/**
+ * Setup compactor
+ * Watch the compaction thread's eventfd and start the periodic passes.
+ */
+void ChatServer::setup_compactor() {
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = compactor.event_fd();
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, compactor.event_fd(), &ev) == -1) {
+    throw std::runtime_error("epoll_ctl: compactor failed");
+  }
+  schedule_compaction();
+}
+
+void ChatServer::schedule_compaction() {
+  timers.schedule(COMPACT_INTERVAL_MS, [this]() {
+    run_compaction(false);
+    schedule_compaction();
+  });
+}
+
+/**
+ * Run a compaction pass
+ * @param force: also revisit archives swept less than RECOMPACT_MS ago
+ * Trims the in-memory tails to the retention policies, then hands sealed
+ * segments beyond the newest WARM_SEGMENTS to the compaction thread, along
+ * with archives due for another retention pass.
+ */
+void ChatServer::run_compaction(bool force) {
+  std::unordered_map<std::string, RetentionCutoff> cutoffs;
+  for (const auto &entry : groupRetention) {
+    std::string key = "g:" + entry.first;
+    RetentionCutoff cutoff = retention_cutoff(key);
+    cutoffs[key] = cutoff;
+    auto hot = hotHistory.find(key);
+    while (hot != hotHistory.end() && !hot->second.empty() &&
+           (hot->second.front().seq < cutoff.minSeq ||
+            hot->second.front().time < cutoff.minTime))
+      hot->second.pop_front();
+  }
+
+  auto submit = [&](uint32_t index, bool from_archive) {
+    if (!compacting.insert(index).second)
+      return;
+    compactor.submit(CompactionJob{
+        index,
+        from_archive ? journal.archive_path(index) : journal.segment_path(index),
+        from_archive, journal.archive_path(index), cutoffs});
+  };
+
+  std::vector<uint32_t> sealed = journal.sealed_segments();
+  for (size_t i = 0; i + WARM_SEGMENTS < sealed.size(); ++i)
+    submit(sealed[i], false);
+
+  if (cutoffs.empty())
+    return;
+  int64_t now = unix_ms();
+  for (uint32_t index : journal.archived_segments()) {
+    int64_t &swept = archiveSweptAt[index];
+    if (force || now - swept >= RECOMPACT_MS) {
+      swept = now;
+      submit(index, true);
+    }
+  }
+}
+
+/**
+ * Finish compactions
+ * Install the archives the compaction thread wrote and move the sparse
+ * index entries of their segments to the new offsets (or drop them with
+ * their expired messages).
+ */
+void ChatServer::finish_compaction() {
+  for (const CompactionResult &result : compactor.take_results()) {
+    compacting.erase(result.segment);
+    if (!result.ok) {
+      std::cerr << "journal: compaction of segment " << result.segment
+                << " failed" << std::endl;
+      continue;
+    }
+    journal.install_archive(result.segment, result.empty);
+    if (result.empty)
+      archiveSweptAt.erase(result.segment);
+
+    for (auto &entry : historyIndex) {
+      std::vector<IndexEntry> &sparse = entry.second.sparse;
+      sparse.erase(
+          std::remove_if(sparse.begin(), sparse.end(),
+                         [&result](IndexEntry &index_entry) {
+                           if (index_entry.at.segment != result.segment)
+                             return false;
+                           auto moved = result.remap.find(index_entry.seq);
+                           if (moved == result.remap.end())
+                             return true;
+                           index_entry.at.offset = moved->second;
+                           return false;
+                         }),
+          sparse.end());
+    }
+    std::cout << "Compacted segment " << result.segment << ": kept "
+                << result.kept << ", dropped " << result.dropped << std::endl;
+  }
+}
+
+/**
+ * Queue ephemeral event
+ * @param receiver_fd: recipient file descriptor
+ * @param key: identifies the event source, e.g. "typing alice #group"
+ * @param text: rendered event; replaces any pending event with the same key
+ * Ephemeral events (typing, status) are coalesced per recipient and sent
+ * once per timer tick. They are never stored anywhere.
+ */
+void ChatServer::queue_ephemeral(int receiver_fd, const std::string &key,
+                                 const std::string &text) {
+  pendingEphemeral[receiver_fd][key] = text;
+  if (!ephemeralFlushScheduled) {
+    ephemeralFlushScheduled = true;
+    timers.schedule(TICK_MS, [this]() { flush_ephemeral(); });
+  }
+}
+
+/**
+ * Flush ephemeral events
+ * Send each recipient its coalesced events in one write. Recipients whose
+ * socket already holds EPHEMERAL_BACKLOG_LIMIT unsent bytes lose them:
+ * chat traffic goes first. Flow-controlled clients without credit lose them too.
+ */
+void ChatServer::flush_ephemeral() {
+  ephemeralFlushScheduled = false;
+  for (auto &entry : pendingEphemeral) {
+    int receiver_fd = entry.first;
+    auto fc = flowControl.find(receiver_fd);
+    if (clients.find(receiver_fd) == clients.end() ||
+        output_backlog(receiver_fd) > EPHEMERAL_BACKLOG_LIMIT ||
+        (fc != flowControl.end() && fc->second.credits == 0)) {
+      continue;
+    }
+    std::string batch = LIGHT_CYAN;
+    for (const auto &event : entry.second)
+      batch += event.second;
+    batch += RESET;
+    send_to(receiver_fd, batch, Lane::BULK);
+  }
+  pendingEphemeral.clear();
+}
+
 /**
  * Broadcast message
  * @param message: message to broadcast
@@ -489,43 +5383,125 @@ void ChatServer::process_authenticated_message(int client_fd,
 void ChatServer::broadcast_message(const char *message, size_t length,
                                    int sender_fd, bool server_broadcast) {
 
+  // The frame is the same for every recipient, so encode it once.
+  std::string s_message(message, length);
+  if (server_broadcast)
+    s_message = GREEN + s_message + RESET;
+  else
+    s_message = BLUE + fdTousername[sender_fd] + RESET + ": " + GREEN +
+                s_message + RESET;
+
+  std::vector<int> recipients;
+  recipients.reserve(clients.size());
   for (int client_fd : clients) {
-    if (client_fd != sender_fd && client_fd != listener_fd) {
-      std::string s_message(message);
-      if (server_broadcast)
-        s_message = GREEN + s_message + RESET;
-      else
-        s_message = BLUE + fdTousername[sender_fd] + RESET + ": " + GREEN +
-                    s_message + RESET;
-      send(client_fd, s_message.c_str(), s_message.size(), 0);
+    if (client_fd != sender_fd && client_fd != listener_fd)
+      recipients.push_back(client_fd);
+  }
+  uint64_t sender = server_broadcast ? 0 : user_hash(fdTousername[sender_fd]);
+  drop_muted(recipients, sender);
+  if (!server_broadcast)
+    topRecipients.record("*", length, recipients.size());
+  if (server_broadcast) {
+    schedule_fanout("*", recipients, s_message);
+    return;
+  }
+  uint64_t seq = journal_message("b", s_message, sender);
+  std::string tagged = tag_record(seq, "b", s_message);
+  schedule_fanout("*", recipients, s_message, tagged);
+  if (syncClients.count(sender_fd) > 0)
+    send_to(sender_fd, tagged, Lane::BULK);
+}
+
+/**
+ * Adapt the epoll batch size to the measured load
+ * @param num_events: number of events returned by the last epoll_wait
+ * A full batch means more events are already queued in the kernel, so the
+ * batch doubles (up to MAX_EVENTS). If the loop stays under a quarter of
+ * its batch for SHRINK_AFTER iterations, the batch halves again (down to
+ * MIN_EVENTS). The event buffer itself always holds MAX_EVENTS; the batch
+ * only caps how many events one epoll_wait() hands back, so under light
+ * load the loop gets back to logins and fanout after fewer handlers.
+ */
+void ChatServer::adapt_event_batch(int num_events) {
+  if (num_events == event_batch && event_batch < MAX_EVENTS) {
+    event_batch = std::min(event_batch * 2, MAX_EVENTS);
+    quiet_iterations = 0;
+    if (DEBUG)
+      std::cout << "epoll batch grown to " << event_batch << std::endl;
+  } else if (num_events < event_batch / 4 && event_batch > MIN_EVENTS) {
+    if (++quiet_iterations >= SHRINK_AFTER) {
+      event_batch = std::max(event_batch / 2, MIN_EVENTS);
+      quiet_iterations = 0;
+      if (DEBUG)
+        std::cout << "epoll batch shrunk to " << event_batch << std::endl;
     }
+  } else {
+    quiet_iterations = 0;
   }
 }
 
 void ChatServer::run() {
+  check_gateways();
+  recover_state();
   setup_listener();
+  setup_admin_listener();
+  setup_ws_listener();
+  setup_timer();
+  schedule_journal_sync();
+  setup_compactor();
 
   std::vector<struct epoll_event> events(MAX_EVENTS);
 
   while (true) {
-    int num_events = epoll_wait(epoll_fd, events.data(), MAX_EVENTS, -1);
+    // Blocks indefinitely when idle, so an idle server uses no CPU; only
+    // polls while logins or fanout work are pending.
+    int timeout = fanoutRing.empty() && pendingLogins.empty() ? -1 : 0;
+    int num_events = epoll_wait(epoll_fd, events.data(), event_batch, timeout);
     if (num_events == -1) {
+      if (errno == EINTR)
+        continue;
       perror("epoll_wait");
       break;
     }
 
     for (int i = 0; i < num_events; ++i) {
-      if (events[i].data.fd == listener_fd) {
-        handle_new_connection();
+      int fd = events[i].data.fd;
+      if (fd == listener_fd || fd == ws_listener_fd) {
+        handle_new_connection(fd);
+      } else if (fd == timer_fd) {
+        handle_timer_tick();
+      } else if (fd == compactor.event_fd()) {
+        finish_compaction();
+      } else if (fd == admin_fd) {
+        handle_new_admin();
+      } else if (admins.find(fd) != admins.end()) {
+        if (events[i].events & EPOLLOUT)
+          flush_output(fd);
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+          handle_admin_message(fd);
       } else {
-        handle_client_message(events[i].data.fd);
+        if (events[i].events & EPOLLOUT)
+          flush_output(fd);
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+          handle_client_message(fd);
+
+        // Peer closed or the socket failed: read what is left, then evict.
+        if ((events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+            connections.find(fd) != connections.end()) {
+          disconnect_client(fd);
+        }
       }
     }
+
+    process_logins();
+    run_fanout();
+    adapt_event_batch(num_events);
   }
 }
 
 int main() {
   signal(SIGINT, sigint_handler); // Handle Ctrl+C gracefully
+  signal(SIGPIPE, SIG_IGN);       // Dead peers surface as send() errors
   try {
     ChatServer server;
     server.run();
@@ -1,9 +1,17 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_set>
 #include <unordered_map>
+#include <vector>
 
 enum
 {
@@ -11,7 +19,19 @@ enum
     SUCCESS
 };
 
-enum class ClientState { WAITING_USERNAME, WAITING_PASSWORD, AUTHENTICATED };
+constexpr int64_t TICK_MS = 500;    // Timer wheel resolution
+constexpr size_t WHEEL_SLOTS = 64;  // Timer wheel slots (one revolution = 32s)
+constexpr const char *JOURNAL_DIR = "journal"; // Directory holding the journal segments
+
+enum class Lane { CONTROL, BULK };   // Output lanes, drained in this order
+
+enum class QosClass { REALTIME, NORMAL, BULK }; // Fanout classes, weighted 8:4:1
+
+enum class RecordKind : uint8_t { MESSAGE = 1, GROUP_CREATE = 2, GROUP_JOIN = 3, GROUP_LEAVE = 4, RETENTION = 5, MUTE = 6,
+                                  SCHEDULE = 7, SCHEDULE_DONE = 8, GROUP_IMPORT = 9,
+                                  CHANNEL = 10 };
+
+enum class ClientState { WAITING_USERNAME, WAITING_PASSWORD, AUTHENTICATING, AUTHENTICATED };
 
 const std::string BLUE = "\033[34m";        // Light Blue for usernames
 const std::string GREEN = "\033[32m";       // Light Blue for usernames
@@ -24,10 +44,33 @@ std::string help_message = "\n" +
                                  LIGHT_CYAN + "Available commands" + RESET + ":\n" +
                                  LIGHT_GREEN + "/msg <username> <message>" + RESET + " : Send a message to a user\n" +
                                  LIGHT_GREEN + "/broadcast <message>" + RESET + " : Send a message to all users\n" +
+                                 LIGHT_GREEN + "/who [<prefix>] [after <username>]" + RESET + " : List online users\n" +
+                                 LIGHT_GREEN + "/list_groups [<prefix>] [after <groupname>]" + RESET + " : List groups\n" +
                                  LIGHT_GREEN + "/create_group <groupname>" + RESET + " : Create a group\n" +
                                  LIGHT_GREEN + "/join_group <groupname>" + RESET + " : Join a group\n" +
                                  LIGHT_GREEN + "/leave_group <groupname>" + RESET + " : Leave a group\n" +
                                  LIGHT_GREEN + "/group_msg <groupname> <message>" + RESET + " : Send a message to a group\n" +
+                                 LIGHT_GREEN + "/create_channel <channel>" + RESET + " : Create a read-only channel you publish to\n" +
+                                 LIGHT_GREEN + "/add_publisher <channel> <username>" + RESET + " : Let another user publish to your channel\n" +
+                                 LIGHT_GREEN + "/channel_msg <channel> <message>" + RESET + " : Send a message to a channel's observers\n" +
+                                 LIGHT_GREEN + "/digest <groupname> <seconds> [<messages>]|off" + RESET + " : Get a group's messages in batches\n" +
+                                 LIGHT_GREEN + "/mute [<username>]" + RESET + " : Hide a user's group and broadcast messages (no name: list)\n" +
+                                 LIGHT_GREEN + "/block <username>" + RESET + " : Also refuse the user's direct messages\n" +
+                                 LIGHT_GREEN + "/unmute <username>" + RESET + " : Undo /mute or /block\n" +
+                                 LIGHT_GREEN + "/schedule <delay|time> <username|#groupname> <message>" + RESET + " : Send a message later (delay: 90, 30s, 10m, 2h, 1d; time: HH:MM or @<unix time>)\n" +
+                                 LIGHT_GREEN + "/schedule" + RESET + " : List your scheduled messages; /unschedule <id> cancels one\n" +
+                                 LIGHT_GREEN + "/typing <username|#groupname>" + RESET + " : Show that you are typing\n" +
+                                 LIGHT_GREEN + "/status <text>" + RESET + " : Set your status for your groups and chat partners\n" +
+                                 LIGHT_GREEN + "/group_qos <groupname> realtime|normal|bulk" + RESET + " : Set the delivery class of a group\n" +
+                                 LIGHT_GREEN + "/dedup on|off" + RESET + " : Drop your own repeats of a message to the same target within 5s\n" +
+                                 LIGHT_GREEN + "/dedup <groupname> on|off" + RESET + " : Drop repeated group messages from any sender\n" +
+                                 LIGHT_GREEN + "/idem <key> <command>" + RESET + " : Run a command at most once per key (safe retries)\n" +
+                                 LIGHT_GREEN + "/credit <n>|off" + RESET + " : Accept n more group/broadcast messages (flow control)\n" +
+                                 LIGHT_GREEN + "/sync <seq>" + RESET + " : Tag messages with sequence numbers and replay those after <seq>\n" +
+                                 LIGHT_GREEN + "/history <group|user> [before <seq>] [limit <n>]" + RESET + " : Show earlier messages\n" +
+                                 LIGHT_GREEN + "/retention <groupname> [<max age seconds> <max bytes>]" + RESET + " : Show or (creator only) set how long group history is kept (0 = no limit)\n" +
+                                 LIGHT_GREEN + "/ping <token>" + RESET + " : Measure latency (reply: PONG <token> <server receive us> <server send us>)\n" +
+                                 LIGHT_GREEN + "/heartbeat" + RESET + " : Ask the server to ping this connection when idle (reply /pong <token>)\n" +
                                  LIGHT_GREEN + "CLOSE" + RESET + " : Close the connection\n";
 
 struct ClientSession {
@@ -36,29 +79,680 @@ struct ClientSession {
     std::string usernameCandidate;  // store the username entered
 };
 
+/**
+ * Open journal segment, shared by queued sendfile() output so a segment
+ * deleted in the meantime stays readable until that output is written.
+ */
+struct SegmentFile {
+    int fd;
+    explicit SegmentFile(int fd) : fd(fd) {}
+    ~SegmentFile();
+    SegmentFile(const SegmentFile &) = delete;
+    SegmentFile &operator=(const SegmentFile &) = delete;
+};
+
+/**
+ * One queued piece of output: a shared buffer, or a byte range of a
+ * journal segment sent with sendfile().
+ */
+struct OutItem {
+    OutItem() = default;
+    explicit OutItem(std::shared_ptr<const std::string> buf) : buf(std::move(buf)) {}
+
+    std::shared_ptr<const std::string> buf;
+    std::shared_ptr<SegmentFile> file;
+    uint64_t offset = 0;            // file range start
+    size_t length = 0;              // file range length
+    size_t size() const { return buf ? buf->size() : length; }
+};
+
+struct Connection {
+    int fd;                         // file descriptor of the client
+    uint64_t id;                    // unique id, guards timers against fd reuse
+    int64_t lastActivity;           // time of the last inbound data (ms)
+    bool heartbeat;                 // client answers server pings
+    uint64_t pingToken;             // outstanding ping token, 0 if none
+    int64_t pingSentAt;             // time the outstanding ping was sent (ms)
+    std::deque<OutItem> lanes[2];   // queued output per Lane
+    int partialLane = -1;           // lane whose front buffer is half written
+    size_t headOffset = 0;          // bytes of that buffer already written
+    size_t queuedBytes = 0;         // bytes waiting in both lanes
+    uint64_t droppedBulk = 0;       // bulk messages dropped since the queue last drained
+    bool wantWrite = false;         // EPOLLOUT armed
+    std::string inbuf;              // unterminated input line (plain TCP clients)
+    bool discarding = false;        // dropping the rest of an oversized line
+    uint64_t streamLock = 0;        // stream being written to this client, 0 if none
+    std::deque<std::pair<OutItem, Lane>> deferred; // output held until that stream ends
+    size_t deferredBytes = 0;       // bytes in deferred, counted against OUTQUEUE_LIMIT
+};
+
+/**
+ * A long message relayed while it is still arriving.
+ * Plain TCP recipients get each chunk as soon as it is read; everyone else
+ * (WebSocket, gateway, /sync and flow-controlled clients) gets the whole
+ * message once the sender's newline arrives.
+ */
+struct OutStream {
+    uint64_t id;
+    std::string key;                // journal conversation key
+    std::string group;              // fanout queue ("*" = broadcast), empty for /msg
+    std::string receiver;           // /msg recipient
+    std::string text;               // rendered message so far, kept once for the journal
+    std::string suffix;             // rendered after the final newline
+    std::vector<int> live;          // recipients receiving chunks
+    std::vector<uint64_t> liveIds;  // their connection ids
+    std::vector<int> later;         // recipients served when the message is complete
+    int64_t started;                // time the stream started (ms)
+    int64_t lastChunk;              // time of the last chunk (ms)
+};
+
+/**
+ * Hashed timer wheel driven by the event loop.
+ * Timers are bucketed by expiry tick; entries that need more than one
+ * revolution stay in their slot until their tick comes round.
+ */
+class TimerWheel
+{
+public:
+    TimerWheel(size_t slots, int64_t tick_ms)
+        : wheel(slots), tickMs(tick_ms), currentTick(0) {}
+
+    void start(int64_t now_ms) { currentTick = now_ms / tickMs; }
+    void schedule(int64_t delay_ms, std::function<void()> fn);
+    void advance(int64_t now_ms);
+    int64_t tick_ms() const { return tickMs; }
+
+private:
+    struct Entry {
+        int64_t dueTick;
+        std::function<void()> fn;
+    };
+    std::vector<std::vector<Entry>> wheel;
+    int64_t tickMs;
+    int64_t currentTick;
+};
+
+/**
+ * Hierarchical timing wheel for scheduled messages.
+ * Four levels of 64 slots: one second per slot at the bottom and 64 times
+ * coarser at each level up (about 194 days in all); later entries wait in
+ * an overflow list. Entries move down a level as their time approaches,
+ * so each is touched at most once per level however far ahead it is.
+ */
+class ScheduleWheel
+{
+public:
+    void start(int64_t now_ms) { current = now_ms / 1000; }
+    void add(uint64_t id, int64_t due_ms);
+    std::vector<uint64_t> advance(int64_t now_ms);
+
+private:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 6;
+    struct Entry {
+        uint64_t id;
+        int64_t dueSec;
+    };
+    void place(const Entry &entry);
+    std::vector<Entry> slots[LEVELS][1 << SLOT_BITS];
+    std::vector<Entry> overflow;
+    std::vector<Entry> ready;       // due by the time they were added
+    int64_t current = 0;            // unix time (s) processed so far
+};
+
+/**
+ * Time-bounded ring of message fingerprints.
+ * Holds the last DEDUP_RING fingerprints seen in one scope; an entry stops
+ * matching once its window expires or it is overwritten by newer traffic.
+ */
+class DuplicateFilter
+{
+public:
+    bool seen(uint64_t fingerprint, int64_t now_ms, int64_t window_ms);
+
+private:
+    struct Slot {
+        uint64_t fingerprint = 0;
+        int64_t expires = 0;
+    };
+    static constexpr size_t DEDUP_RING = 32;
+    Slot ring[DEDUP_RING];
+    size_t next = 0;
+};
+
+/**
+ * Idempotency keys of one user, each remembered for a fixed window.
+ * Keys expire in the order they were recorded, so expired ones come off
+ * the front of a queue; at most MAX_KEYS live keys are kept.
+ */
+class IdempotencyKeys
+{
+public:
+    bool seen(uint64_t key, int64_t now_ms);
+    void record(uint64_t key, int64_t now_ms, int64_t window_ms);
+    bool empty() const { return expires.empty(); }
+
+private:
+    static constexpr size_t MAX_KEYS = 4096;
+    void expire(int64_t now_ms);
+    std::unordered_map<uint64_t, int64_t> expires;      //? key fingerprint -> expiry (ms)
+    std::deque<std::pair<int64_t, uint64_t>> order;     // (expiry, key), oldest first
+};
+
+/**
+ * Users one user has muted or blocked, keyed by username hash.
+ * A 256-bit Bloom filter answers most lookups during fanout without
+ * touching the exact map; it is rebuilt when an entry is removed.
+ */
+class MuteList
+{
+public:
+    void add(uint64_t hash, const std::string &username, bool block);
+    bool remove(uint64_t hash);
+    bool mutes(uint64_t hash) const;
+    bool blocks(uint64_t hash) const;
+    bool empty() const { return exact.empty(); }
+    std::vector<std::string> names(bool blocked) const;
+
+private:
+    struct Entry {
+        std::string username;
+        bool block;                 // also refuses direct messages
+    };
+    bool maybe(uint64_t hash) const;
+    uint64_t bloom[4] = {};
+    std::unordered_map<uint64_t, Entry> exact;
+};
+
+/**
+ * Sorted names served as pages of pre-encoded text.
+ * Names live in chunks of up to 2 * CHUNK; each chunk caches its encoded
+ * form, and a change invalidates only the chunk it touches. Pages end at
+ * chunk boundaries, so the cursor of a full page ("after <last name>")
+ * starts the next page on a chunk boundary, served from the cache.
+ */
+class SortedListing
+{
+public:
+    static constexpr size_t CHUNK = 128;
+
+    void insert(const std::string &name);
+    void erase(const std::string &name);
+    size_t size() const { return count; }
+    std::shared_ptr<const std::string> page(const std::string &prefix, const std::string &after,
+                                            std::string &last, bool &more);
+
+private:
+    struct Chunk {
+        std::vector<std::string> names;             // sorted
+        std::shared_ptr<const std::string> encoded; // one name per line, null when stale
+    };
+    size_t locate(const std::string &name) const;
+    std::vector<Chunk> chunks;
+    size_t count = 0;
+};
+
+/**
+ * Heavy-hitter statistics in constant memory.
+ * A count-min sketch estimates message count and bytes per key; two small
+ * min-heaps keep the TOP_K keys with the largest estimates.
+ */
+class HeavyHitters
+{
+public:
+    static constexpr size_t TOP_K = 16;
+
+    HeavyHitters();
+    void record(const std::string &key, uint64_t bytes, uint64_t copies = 1);
+    std::vector<std::pair<std::string, uint64_t>> top(bool by_bytes) const;
+
+private:
+    static constexpr size_t DEPTH = 4;
+    static constexpr size_t WIDTH = 2048;
+    struct Candidate {
+        std::string key;
+        uint64_t estimate;
+    };
+    uint64_t update(std::vector<uint64_t> &sketch, uint64_t hash, uint64_t amount);
+    void offer(std::vector<Candidate> &heap, const std::string &key, uint64_t estimate);
+
+    std::vector<uint64_t> countSketch;  // DEPTH x WIDTH counters
+    std::vector<uint64_t> byteSketch;
+    std::vector<Candidate> topCount;    // min-heaps on estimate
+    std::vector<Candidate> topBytes;
+};
+
+struct FlowControl {
+    uint64_t credits = 0;                                   // group/broadcast messages the client accepts
+    std::deque<std::shared_ptr<const std::string>> held;    // messages waiting for credit
+    uint64_t skipped = 0;                                   // messages dropped once held was full
+};
+
+struct PendingLogin {
+    int fd;                         // client file descriptor or logical session id
+    uint64_t connectionId;          // guards against fd reuse while queued
+    std::string username;
+    std::string password;
+};
+
+struct FanoutJob {
+    std::shared_ptr<const std::string> data;    // message, encoded once
+    std::shared_ptr<const std::string> wsFrame; // WebSocket frame, built on first use
+    std::shared_ptr<const std::string> tagged;  // sequence-tagged record for /sync clients, may be null
+    std::vector<int> recipients;                // recipients snapshot at send time
+    std::vector<uint64_t> connectionIds;        // guards against fd reuse
+    size_t next = 0;                            // first recipient not served yet
+};
+
+struct FanoutQueue {
+    std::deque<FanoutJob> jobs;
+    size_t deficit = 0;                         // deficit round robin credit
+    bool active = false;                        // present in the round robin ring
+};
+
+/**
+ * Read-only broadcast channel. Publishers post and observers only receive.
+ * Observers are bare connections: no session, username or group entries,
+ * and their input is discarded unparsed.
+ */
+struct Channel {
+    std::unordered_set<std::string> publishers;
+    std::vector<int> observers;     // observer fds, handed to the fanout as is
+};
+
+struct ObserverRef {
+    Channel *channel;               // stable: channels are never erased
+    size_t slot;                    // index in channel->observers
+};
+
+/**
+ * Delivery mode of a group. Push sends each message to every online
+ * member; pull sends it only to members who are reading and lets the
+ * others catch up from their cursor when they become active.
+ */
+struct GroupDelivery {
+    bool pull = false;
+    double readRate = 1.0;          // moving average of the share of members reading
+    uint64_t pullSince = 0;         // last message pushed to everyone before pull mode
+    uint64_t pullUntil = 0;         // last message sent in pull mode, once back to push
+};
+
+struct LogicalSession {
+    int gatewayFd;                  // gateway connection carrying the session
+    std::string sid;                // session id chosen by the gateway
+};
+
+struct Gateway {
+    std::string name;                                   // gateway name from gateways.txt
+    std::string inbuf;                                  // partial inbound line
+    std::unordered_map<std::string, int> sidToSession;  // sid -> logical session id
+};
+
+struct WebSocketConn {
+    bool upgraded = false;          // HTTP upgrade completed
+    std::string inbuf;              // undecoded bytes
+    std::string fragments;          // payload of an unfinished message
+};
+
+/**
+ * On-disk header of a journal record, followed by the key, the sender's
+ * user_hash() when RECORD_HAS_SENDER is set, and the text.
+ * The CRC covers everything after the crc field.
+ */
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t length;                // whole record, header included
+    uint32_t crc;
+    uint8_t kind;                   // RecordKind
+    uint8_t flags;                  // RECORD_HAS_SENDER
+    uint16_t keyLen;
+    uint64_t seq;
+    int64_t time;                   // unix time (ms)
+};
+static_assert(sizeof(RecordHeader) == 32, "journal record header must stay 32 bytes");
+
+constexpr uint8_t RECORD_HAS_SENDER = 1;
+
+/** Offset of a record's text from the start of the record */
+inline size_t record_text_offset(const RecordHeader &header) {
+    return sizeof(header) + header.keyLen +
+           ((header.flags & RECORD_HAS_SENDER) ? sizeof(uint64_t) : 0);
+}
+
+struct RecordLocation {
+    uint32_t segment;               // segment file index
+    uint64_t offset;                // byte offset within the segment
+};
+
+struct JournalRecord {
+    uint64_t seq;
+    int64_t time;                   // unix time (ms)
+    RecordKind kind;
+    std::string key;                // "b", "g:<group>" or "d:<user>|<user>"
+    std::string text;               // rendered message, or a username for membership records
+    uint32_t segment;               // segment file index
+    uint64_t offset;                // record offset within the segment
+    uint64_t sender = 0;            // sender's user_hash(), 0 if not recorded
+};
+
+/**
+ * Append-only journal split into numbered segment files.
+ * Records carry a global sequence number and a CRC32, so a torn write at
+ * the tail is detected and cut off when the journal is reopened.
+ */
+class Journal
+{
+public:
+    explicit Journal(const std::string &dir) : dir(dir) {}
+    ~Journal();
+
+    void open(const std::function<void(const JournalRecord &)> &replay);
+    uint64_t append(RecordKind kind, const std::string &key, const std::string &text,
+                    uint64_t sender = 0);
+    void sync();
+    uint64_t last_seq() const { return lastSeq; }
+    RecordLocation last_location() const { return lastLocation; }
+    void scan(RecordLocation from,
+              const std::function<bool(const RecordHeader &, const char *, RecordLocation)> &visit) const;
+    std::shared_ptr<SegmentFile> segment_file(uint32_t index);
+    std::string segment_path(uint32_t index) const;
+    std::string archive_path(uint32_t index) const;
+    bool archived(uint32_t index) const { return archives.count(index) > 0; }
+    std::vector<uint32_t> sealed_segments() const;
+    std::vector<uint32_t> archived_segments() const;
+    void install_archive(uint32_t index, bool empty);
+
+private:
+    void open_segment(uint32_t index);
+
+    std::string dir;
+    std::vector<uint32_t> segments;  // existing segment indexes, ascending
+    std::unordered_set<uint32_t> archives; // segments compacted into archive files
+    std::unordered_map<uint32_t, std::shared_ptr<SegmentFile>> readers; // read-only handles for sendfile()
+    RecordLocation lastLocation = {0, 0}; // location of the last appended record
+    int fd = -1;                    // active segment, opened O_APPEND
+    uint32_t activeSegment = 0;
+    uint64_t activeSize = 0;
+    uint64_t lastSeq = 0;
+    bool dirty = false;             // appended since the last sync()
+};
+
+struct IndexEntry {
+    uint64_t seq;
+    RecordLocation at;
+    uint64_t bytesBefore;           // conversation bytes before this message
+};
+
+/**
+ * Sparse index of one conversation in the journal: the location of every
+ * HISTORY_INDEX_STRIDE-th message, so history reads start close to the
+ * requested range instead of at the beginning of the journal.
+ */
+struct ConversationIndex {
+    uint64_t count = 0;             // messages in the conversation
+    uint64_t bytes = 0;             // their total size
+    uint64_t lastSeq = 0;           // newest message, where history scans stop
+    std::vector<IndexEntry> sparse;
+};
+
+struct HotEntry {
+    uint64_t seq;
+    int64_t time;                   // unix time (ms)
+    uint64_t sender;                // username hash, 0 if unknown
+    std::shared_ptr<const std::string> text;
+};
+
+/**
+ * Digest subscription of one member to one group: messages are buffered
+ * and sent as a single batch every intervalMs or maxMessages messages.
+ */
+struct DigestSubscription {
+    int64_t intervalMs;
+    size_t maxMessages;
+    std::vector<HotEntry> pending;  // buffered messages, oldest first
+    size_t pendingBytes = 0;        // text bytes in pending
+    uint64_t timer = 0;             // id of the pending flush timer, 0 if none
+};
+
+struct ScheduledMessage {
+    int64_t dueMs;                  // unix time (ms)
+    std::string sender;
+    std::string target;             // "#group" or a username
+    std::string text;               // message, newline-terminated
+};
+
+struct RetentionPolicy {
+    int64_t maxAgeMs = 0;           // 0 = no age limit
+    uint64_t maxBytes = 0;          // 0 = no size limit
+    std::string setBy;              // user who set it, "admin" from the admin socket
+};
+
+struct RetentionCutoff {
+    uint64_t minSeq = 0;            // older messages are expired
+    int64_t minTime = 0;            // messages before this unix time (ms) are expired
+};
+
+struct CompactionJob {
+    uint32_t segment;
+    std::string source;             // raw segment or archive being rewritten
+    bool fromArchive;
+    std::string target;             // archive file to write
+    std::unordered_map<std::string, RetentionCutoff> cutoffs; //? conversation key -> cutoff
+};
+
+struct CompactionResult {
+    uint32_t segment;
+    bool ok = false;
+    bool empty = false;             // every record expired, nothing written
+    uint64_t kept = 0;
+    uint64_t dropped = 0;
+    std::unordered_map<uint64_t, uint64_t> remap; //? message seq -> offset in the archive
+};
+
+/**
+ * Background thread that rewrites journal segments into compressed
+ * archives. Jobs and results are exchanged under a mutex; the thread
+ * signals finished jobs through an eventfd polled by the event loop.
+ */
+class Compactor
+{
+public:
+    Compactor();
+    ~Compactor();
+
+    void submit(CompactionJob job);
+    std::vector<CompactionResult> take_results();
+    int event_fd() const { return notify_fd; }
+
+private:
+    void work();
+
+    int notify_fd;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<CompactionJob> jobs;
+    std::vector<CompactionResult> results;
+    bool stopping = false;
+    std::thread worker;
+};
+
 
 class ChatServer
 {
 public:
-    ChatServer() : listener_fd(-1), epoll_fd(-1) {}
+    ChatServer() : listener_fd(-1), epoll_fd(-1), timer_fd(-1), admin_fd(-1), ws_listener_fd(-1), event_batch(16), quiet_iterations(0),
+                   next_connection_id(1), timers(WHEEL_SLOTS, TICK_MS) {}
 
     void run();
 
 private:
     int listener_fd;
     int epoll_fd;
+    int timer_fd;                       // periodic tick driving the timer wheel
+    int admin_fd;                       // admin listener on the owner-only Unix socket ADMIN_SOCKET
+    int ws_listener_fd;                 // WebSocket listener
+    int event_batch;                    // current epoll_wait batch size
+    int quiet_iterations;               // consecutive lightly loaded iterations
+    uint64_t next_connection_id;
+    TimerWheel timers;
     std::unordered_set<int> clients;
     std::unordered_set<std::string> activeUsernames;
     std::unordered_map<std::string, int> usernameTofd;                  //? username -> clientfd
     std::unordered_map<int, std::string> fdTousername;                  //? clientfd -> username
     std::unordered_map<std::string, std::unordered_set<int>> groupTofd; //? groupname -> set of clientfds
+    std::unordered_map<int, std::unordered_set<std::string>> fdTogroups; //? clientfd -> groups joined
+    std::unordered_map<std::string, std::unordered_set<std::string>> groupMembers; //? groupname -> usernames (persistent)
+    std::unordered_map<std::string, std::unordered_set<std::string>> userGroups;   //? username -> groupnames (persistent)
+    std::unordered_map<std::string, std::unordered_set<std::string>> userDMs;      //? username -> DM conversation keys
+    std::unordered_map<std::string, std::deque<HotEntry>> hotHistory;   //? conversation key -> recent messages
+    std::unordered_map<std::string, ConversationIndex> historyIndex;    //? conversation key -> sparse journal index
+    std::unordered_map<std::string, RetentionPolicy> groupRetention;    //? groupname -> retention policy
+    std::unordered_map<std::string, std::unordered_map<std::string, uint64_t>> memberSince; //? groupname -> member -> seq of its join
+    std::unordered_map<std::string, std::string> groupCreators;         //? groupname -> creator (absent for imported groups)
+    Compactor compactor;
+    std::unordered_set<uint32_t> compacting;                            //? segments with a compaction job in flight
+    std::unordered_map<uint32_t, int64_t> archiveSweptAt;               //? archived segment -> last retention pass (ms)
+    std::unordered_set<int> syncClients;                                //? clients receiving sequence-tagged records
+    std::unordered_map<int, int64_t> activeReaders;                     //? clientfd -> time of the last command (ms)
+    std::unordered_map<std::string, GroupDelivery> groupDelivery;       //? groupname -> push/pull mode
+    std::unordered_map<std::string, std::unordered_map<std::string, uint64_t>> readCursors; //? groupname -> username -> last message delivered
+    std::unordered_map<std::string, std::unordered_set<int>> groupReaders; //? pull-mode groupname -> members who may be reading
+    std::unordered_map<std::string, std::unordered_map<std::string, uint64_t>> missedUntil; //? groupname -> username -> end of an undelivered pull period
+    std::unordered_map<int, std::unordered_map<std::string, DigestSubscription>> digests; //? clientfd -> groupname -> digest
+    uint64_t next_digest_timer = 1;
+    SortedListing onlineListing;                                        //? online usernames for /who
+    SortedListing groupListing;                                         //? groupnames for /list_groups
+    std::unordered_map<std::string, Channel> channels;                  //? channel name -> publishers and observers
+    std::unordered_map<int, ObserverRef> observers;                     //? observer fd -> its channel
+    std::unordered_map<std::string, MuteList> muteLists;                //? username -> users muted or blocked
+    std::unordered_map<int, const MuteList *> onlineMuters;             //? clientfd -> its user's mute list, online users with one only
+    std::unordered_map<uint64_t, ScheduledMessage> scheduled;           //? id (journal seq) -> pending scheduled message
+    ScheduleWheel scheduleWheel;
+    Journal journal{JOURNAL_DIR};
     std::unordered_map<int, ClientSession> sessions;
-    void process_authenticated_message(int client_fd, const std::string &message);
+    std::unordered_map<int, Connection> connections;                    //? clientfd -> liveness state
+    std::unordered_map<int, Gateway> gateways;                          //? gateway fd -> gateway state
+    std::unordered_map<int, LogicalSession> logicalSessions;            //? logical session id (< 0) -> route
+    int next_logical_session = -1;
+    std::unordered_map<int, WebSocketConn> webSockets;                  //? clientfd -> WebSocket state
+    std::unordered_map<int, FlowControl> flowControl;                   //? clientfd -> credits (opt-in)
+    std::unordered_map<std::string, QosClass> groupQos;                 //? groupname -> class, NORMAL if absent
+    std::unordered_map<std::string, FanoutQueue> fanoutQueues;          //? groupname ("*" = broadcast) -> pending fanout
+    std::deque<std::string> fanoutRing;                                 //? groups with pending fanout
+    std::deque<PendingLogin> pendingLogins;                             //? logins waiting for the next batch
+    std::unordered_map<std::string, std::string> credentials;           //? username -> password (users.txt)
+    int64_t credentialsMtime = 0;                                       //? users.txt mtime (ns) when loaded
+    std::unordered_map<int, OutStream> streams;                         //? sender fd -> message being streamed
+    uint64_t next_stream_id = 1;
+    int64_t receivedAtUs = 0;                                           //? kernel receive time of the data being handled (unix us)
+    std::unordered_map<std::string, DuplicateFilter> senderDedup;       //? username -> recent fingerprints (opt-in)
+    std::unordered_map<std::string, IdempotencyKeys> idempotencyKeys;   //? username -> /idem keys
+    uint64_t errorsSent = 0;                                            //? error replies sent, to tell if a command failed
+    std::unordered_map<std::string, DuplicateFilter> groupDedup;        //? groupname -> recent fingerprints (opt-in)
+    std::unordered_set<int> admins;                                     //? admin connection fds
+    std::unordered_map<int, std::unordered_map<std::string, std::string>> pendingEphemeral; //? clientfd -> event key -> latest text
+    bool ephemeralFlushScheduled = false;
+    HeavyHitters topSenders;
+    HeavyHitters topGroups;
+    HeavyHitters topRecipients;         // delivered copies: per user for /msg, per "#group", "!channel" or "*" for fanout
+    void process_authenticated_message(int client_fd, const std::string &message, bool content_dedup = true);
+    bool suppress_duplicate(int client_fd, const std::string &target, const std::string &msg,
+                            bool content_dedup);
 
     int perform_authentication(const std::string &username, const std::string &password, int client_fd);
     void setup_listener();
-    void handle_new_connection();
+    void handle_new_connection(int listen_fd);
+    void start_session(int client_fd);
+    void setup_ws_listener();
+    void handle_websocket_data(int client_fd, const std::string &data);
     void handle_client_message(int client_fd);
+    void handle_line(int client_fd, const std::string &data);
+    void handle_input(int client_fd);
+    bool start_stream(int client_fd, const std::string &partial);
+    void stream_chunk(int client_fd, const std::string &chunk);
+    void finish_stream(int client_fd);
+    void abort_stream(int client_fd, const std::string &reason);
+    void check_stream(int client_fd, uint64_t id);
+    void release_stream_lock(int client_fd, uint64_t id);
+    void leave_stream(int client_fd);
+    void complete_login(int client_fd, const std::string &username);
+    void queue_login(int client_fd, const std::string &username, const std::string &password);
+    void process_logins();
+    void reload_credentials();
+    void open_gateway(int client_fd, const std::string &credentials);
+    void open_observer(int client_fd, const std::string &args);
+    void handle_gateway_data(int gateway_fd, const std::string &data);
+    void send_to(int client_fd, const std::string &data, Lane lane = Lane::CONTROL);
+    void queue_output(int fd, std::shared_ptr<const std::string> buf, Lane lane);
+    void queue_output(int fd, const std::string &data, Lane lane);
+    void queue_output(int fd, OutItem item, Lane lane);
+    void enqueue_output(Connection &conn, OutItem item, Lane lane);
+    void drop_bulk(Connection &conn);
+    void flush_output(int fd);
+    size_t output_backlog(int client_fd);
+    bool take_credit(int client_fd, const std::shared_ptr<const std::string> &buf);
+    void grant_credit(int client_fd, uint64_t credits);
+    void deliver_many(const std::vector<int> &recipients, const std::string &data);
+    void deliver_many(const std::vector<int> &recipients, const std::shared_ptr<const std::string> &plain,
+                      std::shared_ptr<const std::string> &ws_frame,
+                      const std::shared_ptr<const std::string> &tagged = nullptr);
+    void schedule_fanout(const std::string &group, const std::vector<int> &recipients, const std::string &data,
+                         const std::string &tagged = "");
+    void recover_state();
+    void apply_record(const JournalRecord &record);
+    void add_membership(const std::string &group, const std::string &username, uint64_t seq);
+    void remove_membership(const std::string &group, const std::string &username);
+    uint64_t journal_message(const std::string &key, const std::string &text,
+                             uint64_t sender);
+    void replay_since(int client_fd, uint64_t since);
+    void send_history(int client_fd, const std::string &target, const std::string &key, uint64_t after, uint64_t before,
+                      size_t limit);
+    void schedule_journal_sync();
+    RetentionCutoff retention_cutoff(const std::string &key);
+    void set_retention(const std::string &group, uint64_t age_sec, uint64_t bytes,
+                       const std::string &setter);
+    std::string describe_retention(const std::string &group);
+    bool is_reading(int client_fd, int64_t now);
+    void note_reader(int client_fd);
+    void catch_up(int client_fd);
+    void update_delivery_mode(const std::string &group, uint64_t seq,
+                              size_t reading, size_t members);
+    bool wants_digest(int client_fd, const std::string &group);
+    void add_to_digest(int client_fd, const std::string &group, uint64_t seq,
+                       const std::shared_ptr<const std::string> &text);
+    void flush_digest(int client_fd, const std::string &group);
+    void refresh_muter(const std::string &username);
+    bool is_muted(int receiver_fd, uint64_t sender, bool direct);
+    void drop_muted(std::vector<int> &recipients, uint64_t sender);
+    void send_direct_message(int client_fd, const std::string &sender,
+                             const std::string &receiver, const std::string &msg);
+    void send_group_message(int client_fd, const std::string &sender,
+                            const std::string &group, const std::string &msg);
+    void send_channel_message(int client_fd, const std::string &channel, const std::string &msg);
+    void schedule_message(int client_fd, const std::string &args);
+    void run_scheduled();
+    void setup_compactor();
+    void schedule_compaction();
+    void run_compaction(bool force);
+    void finish_compaction();
+    bool run_fanout();
+    void send_listing(int client_fd, const std::string &command, SortedListing &listing,
+                      const std::string &title, const std::string &args);
+    void send_server(int client_fd, std::string &message);
+    void send_server_error(int client_fd, std::string &message);
+    void disconnect_client(int client_fd);
+    void setup_timer();
+    void setup_admin_listener();
+    void handle_new_admin();
+    void handle_admin_message(int admin_conn);
+    std::string run_admin_command(const std::string &line);
+    std::string import_provisioning(const std::string &path);
+    void handle_timer_tick();
+    void schedule_heartbeat(int client_fd, int64_t delay_ms);
+    void check_heartbeat(int client_fd, uint64_t id);
+    void adapt_event_batch(int num_events);
+    void queue_ephemeral(int receiver_fd, const std::string &key, const std::string &text);
+    void flush_ephemeral();
     void broadcast_message(const char *message, size_t length, int sender_fd, bool server_broadcast = true);
 };
 